@@ -47,6 +47,7 @@ testScripts=(
     'mempool_tx_input_limit.py'
     'mempool_nu_activation.py'
     'mempool_tx_expiry.py'
+    'mempool_persist.py'
     'httpbasics.py'
     'zapwallettxes.py'
     'proxy_test.py'
@@ -58,6 +59,7 @@ testScripts=(
     'key_import_export.py'
     'nodehandling.py'
     'reindex.py'
+    'chainstate_replay.py'
     'addressindex.py'
     'spentindex.py'
     'timestampindex.py'
@@ -76,6 +78,7 @@ testScripts=(
     'p2p_txexpiry_dos.py'
     'p2p_txexpiringsoon.py'
     'p2p_node_bloom.py'
+    'p2p_stalled_block.py'
     'regtest_signrawtransaction.py'
     'finalsaplingroot.py'
     'sprout_sapling_migration.py'
@@ -0,0 +1,71 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zel developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that a node starts after a chainstate flush was interrupted between
+# its partial batches, while it disconnected a block that added a Sapling
+# commitment, by replaying the blocks of that flush.
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, get_coinbase_address, \
+    initialize_chain_clean, log_filename, start_node, stop_node, \
+    wait_and_assert_operationid_status
+
+from decimal import Decimal
+
+SAPLING_TREE_EMPTY_ROOT = "3e49b5f954aa9d3545bc6c37744661eea48d7c34e3000d82b7f0010c30f4c2fb"
+
+
+class ChainstateReplayTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.is_network_split = False
+
+    def run_test(self):
+        self.nodes[0].generate(200)
+
+        # Mine a block that changes the Sapling anchor, and flush it
+        taddr = get_coinbase_address(self.nodes[0])
+        zaddr = self.nodes[0].z_getnewaddress('sapling')
+        myopid = self.nodes[0].z_sendmany(taddr, [{"address": zaddr, "amount": Decimal('20')}], 1, 0)
+        wait_and_assert_operationid_status(self.nodes[0], myopid)
+        self.nodes[0].generate(1)
+        shielded = self.nodes[0].getbestblockhash()
+        parent = self.nodes[0].getblock(shielded)["previousblockhash"]
+        assert(self.nodes[0].getblock(shielded)["finalsaplingroot"] != SAPLING_TREE_EMPTY_ROOT)
+        self.nodes[0].gettxoutsetinfo()
+
+        # Disconnect it, and stop the node with a flush that ends before its
+        # final batch, as if it crashed
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-dbbatchsize=1", "-dbsimulatecrash"])
+        self.nodes[0].invalidateblock(shielded)
+        assert_equal(self.nodes[0].getbestblockhash(), parent)
+        stop_node(self.nodes[0], 0)
+
+        # The node replays the interrupted flush on startup
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+        assert_equal(self.nodes[0].getbestblockhash(), parent)
+        with open(log_filename(self.options.tmpdir, 0, "debug.log")) as log:
+            assert("Rolling back %s" % shielded in log.read())
+        self.nodes[0].gettxoutsetinfo()
+
+        # ... and can connect the block again
+        self.nodes[0].reconsiderblock(shielded)
+        assert_equal(self.nodes[0].getbestblockhash(), shielded)
+        self.nodes[0].generate(1)
+        assert_equal(self.nodes[0].getblockcount(), 202)
+
+if __name__ == '__main__':
+    ChainstateReplayTest().main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zel developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that the mempool, with its entry times and prioritisetransaction
+# deltas, is saved on shutdown and loaded again on startup, unless
+# -persistmempool=0 is given.
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.authproxy import JSONRPCException
+from test_framework.mininode import deser_uint256, deser_vector
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, start_node, stop_node
+
+import os
+import struct
+import time
+
+
+class MempoolDelta(object):
+    """An entry of the prioritisetransaction deltas in mempool.dat."""
+
+    def deserialize(self, f):
+        self.txid = "%064x" % deser_uint256(f)
+        self.priority_delta = struct.unpack("<d", f.read(8))[0]
+        self.fee_delta = struct.unpack("<q", f.read(8))[0]
+
+
+def read_mempool_deltas(path):
+    with open(path, "rb") as f:
+        version = struct.unpack("<Q", f.read(8))[0]
+        assert_equal(version, 1)
+        return dict((d.txid, d) for d in deser_vector(f, MempoolDelta))
+
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        # Just need one node for this test
+        self.nodes = []
+        self.nodes.append(start_node(0, self.options.tmpdir))
+        self.is_network_split = False
+
+    def wait_for_mempool_size(self, size):
+        for i in range(60):
+            if self.nodes[0].getmempoolinfo()["size"] == size:
+                return
+            time.sleep(0.5)
+        assert_equal(self.nodes[0].getmempoolinfo()["size"], size)
+
+    def savemempool_when_loaded(self):
+        # The mempool is marked loaded once the node is done importing
+        for i in range(60):
+            try:
+                self.nodes[0].savemempool()
+                return
+            except JSONRPCException:
+                time.sleep(0.5)
+        self.nodes[0].savemempool()
+
+    def run_test(self):
+        mempooldat = os.path.join(self.options.tmpdir, "node0", "regtest", "mempool.dat")
+        address = self.nodes[0].getnewaddress()
+        txids = [self.nodes[0].sendtoaddress(address, 1) for i in range(5)]
+        self.nodes[0].prioritisetransaction(txids[0], 0, 1000)
+        mempool = self.nodes[0].getrawmempool(True)
+        assert_equal(len(mempool), 5)
+
+        # Restarting keeps the transactions and their entry times. The
+        # wallet is kept from putting its own transactions back.
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-walletbroadcast=0"])
+        self.wait_for_mempool_size(5)
+        reloaded = self.nodes[0].getrawmempool(True)
+        for txid in txids:
+            assert_equal(reloaded[txid]["time"], mempool[txid]["time"])
+        # The delta was loaded too, as it is saved again
+        self.savemempool_when_loaded()
+        deltas = read_mempool_deltas(mempooldat)
+        assert_equal(deltas.keys(), [txids[0]])
+        assert_equal(deltas[txids[0]].fee_delta, 1000)
+
+        # Without -persistmempool nothing is loaded, nor saved over mempool.dat
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-walletbroadcast=0", "-persistmempool=0"])
+        time.sleep(2)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-walletbroadcast=0"])
+        self.wait_for_mempool_size(5)
+
+        # savemempool writes the file without a shutdown
+        os.remove(mempooldat)
+        self.nodes[0].savemempool()
+        assert(os.path.isfile(mempooldat))
+
+        # ... also with -persistmempool=0, where nothing is loaded
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-walletbroadcast=0", "-persistmempool=0"])
+        os.remove(mempooldat)
+        self.savemempool_when_loaded()
+        assert(os.path.isfile(mempooldat))
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
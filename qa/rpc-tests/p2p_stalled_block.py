@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+# Copyright (c) 2019 The Zel developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that blocks a peer holds up the block download window with are
+# requested from a faster peer, and that the staller is not disconnected
+# for stalling once it no longer holds up the window.
+#
+
+import sys; assert sys.version_info < (3,), ur"This script does not run under Python 3. Please use Python 2.7.x."
+
+from test_framework.mininode import NodeConn, NodeConnCB, NetworkThread, \
+    CBlockHeader, msg_headers, mininode_lock, MY_SUBVERSION
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import assert_equal, connect_nodes, \
+    initialize_chain_clean, log_filename, p2p_port, start_nodes
+
+from binascii import unhexlify
+from io import BytesIO
+import time
+
+# BLOCK_DOWNLOAD_WINDOW and MAX_HEADERS_RESULTS in main.h
+BLOCK_DOWNLOAD_WINDOW = 1024
+MAX_HEADERS_RESULTS = 160
+# BLOCK_STALLING_DISCONNECT_TIMEOUT in main.h
+STALLING_DISCONNECT_TIMEOUT = 30
+
+
+class StallingNode(NodeConnCB):
+    """Announces blocks, and never sends the ones requested."""
+
+    def __init__(self):
+        NodeConnCB.__init__(self)
+        self.create_callback_map()
+        self.requested = set()
+
+    def add_connection(self, conn):
+        self.connection = conn
+
+    def on_getdata(self, conn, message):
+        for inv in message.inv:
+            self.requested.add(inv.hash)
+
+
+class StalledBlockTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        # The nodes are connected once the staller holds the first blocks
+        self.nodes = start_nodes(2, self.options.tmpdir, extra_args=[['-debug=net']] * 2)
+        self.is_network_split = True
+
+    def staller_info(self):
+        for peer in self.nodes[0].getpeerinfo():
+            if peer['subver'] == MY_SUBVERSION:
+                return peer
+        return None
+
+    def run_test(self):
+        # More blocks than the window, so that it holds up node 0
+        self.nodes[1].generate(BLOCK_DOWNLOAD_WINDOW + 50)
+        headers = []
+        for height in range(1, self.nodes[1].getblockcount() + 1):
+            header = CBlockHeader()
+            header.deserialize(BytesIO(unhexlify(self.nodes[1].getblockheader(self.nodes[1].getblockhash(height), False))))
+            headers.append(header)
+
+        staller = StallingNode()
+        staller.add_connection(NodeConn('127.0.0.1', p2p_port(0), self.nodes[0], staller))
+        NetworkThread().start()
+        while not staller.verack_received:
+            time.sleep(0.1)
+
+        # The staller is asked for the first blocks
+        for i in range(0, len(headers), MAX_HEADERS_RESULTS):
+            msg = msg_headers()
+            msg.headers = headers[i:i + MAX_HEADERS_RESULTS]
+            staller.connection.send_message(msg)
+        for i in range(100):
+            with mininode_lock:
+                if headers[0].sha256 in staller.requested:
+                    break
+            time.sleep(0.1)
+        with mininode_lock:
+            nStalled = len(staller.requested)
+        assert(nStalled > 0)
+        assert_equal(self.nodes[0].getblockcount(), 0)
+
+        # Node 1 delivers the rest of the window, and then takes over the
+        # blocks of the staller one by one
+        start = time.time()
+        connect_nodes(self.nodes[0], 1)
+        while self.nodes[0].getblockcount() < self.nodes[1].getblockcount():
+            assert(time.time() - start < 4 * STALLING_DISCONNECT_TIMEOUT)
+            time.sleep(0.5)
+        assert_equal(self.nodes[0].getbestblockhash(), self.nodes[1].getbestblockhash())
+        assert_equal(self.staller_info()['blocks_stalled'], nStalled)
+
+        # Once its blocks were handed over, the staller no longer holds up
+        # the window, and is not disconnected for it
+        time.sleep(STALLING_DISCONNECT_TIMEOUT + 5)
+        assert(self.staller_info() is not None)
+        with open(log_filename(self.options.tmpdir, 0, "debug.log")) as log:
+            assert("is stalling block download" not in log.read())
+
+        staller.connection.disconnect_node()
+
+if __name__ == '__main__':
+    StalledBlockTest().main()
@@ -6,11 +6,13 @@
 
 #include "primitives/transaction.h"
 #include "hash.h"
+#include "memusage.h"
 #include "script/script.h"
 #include "script/standard.h"
 #include "random.h"
 #include "streams.h"
 
+#include <algorithm>
 #include <math.h>
 #include <stdlib.h>
 
@@ -41,17 +43,6 @@ CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int
 {
 }
 
-// Private constructor used by CRollingBloomFilter
-CBloomFilter::CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweakIn) :
-    vData((unsigned int)(-1  / LN2SQUARED * nElements * log(nFPRate)) / 8),
-    isFull(false),
-    isEmpty(true),
-    nHashFuncs((unsigned int)(vData.size() * 8 / nElements * LN2)),
-    nTweak(nTweakIn),
-    nFlags(BLOOM_UPDATE_NONE)
-{
-}
-
 inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
@@ -122,12 +113,6 @@ void CBloomFilter::clear()
     isEmpty = true;
 }
 
-void CBloomFilter::reset(unsigned int nNewTweak)
-{
-    clear();
-    nTweak = nNewTweak;
-}
-
 bool CBloomFilter::IsWithinSizeConstraints() const
 {
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
@@ -216,30 +201,58 @@ void CBloomFilter::UpdateEmptyFull()
     isEmpty = empty;
 }
 
-CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate) :
-    b1(nElements * 2, fpRate, 0), b2(nElements * 2, fpRate, 0)
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
 {
-    // Implemented using two bloom filters of 2 * nElements each.
-    // We fill them up, and clear them, staggered, every nElements
-    // inserted, so at least one always contains the last nElements
-    // inserted.
-    nInsertions = 0;
-    nBloomSize = nElements * 2;
-
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), but
+    // restrict it to the range 1-50.
+    nHashFuncs = std::max(1, std::min((int)round(logFpRate / log(0.5)), 50));
+    // Entries are kept in generations of nElements / 2; between two and three
+    // generations are remembered at any time, so at least the last nElements.
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    uint32_t nMaxElements = nEntriesPerGeneration * 3;
+    // Size the filter for fpRate when it holds nMaxElements:
+    //   fpRate = pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+    uint32_t nFilterBits = (uint32_t)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    // Position P is stored in bit (P & 63) of both data[(P >> 6) * 2] and
+    // data[(P >> 6) * 2 + 1]. Both bits clear means the position is unset;
+    // otherwise they give the generation that set it.
+    data.resize(((nFilterBits + 63) / 64) << 1);
     reset();
 }
 
+static inline uint32_t RollingBloomHash(unsigned int nHashNum, uint32_t nTweak, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash);
+}
+
 void CRollingBloomFilter::insert(const std::vector<unsigned char>& vKey)
 {
-    if (nInsertions == 0) {
-        b1.clear();
-    } else if (nInsertions == nBloomSize / 2) {
-        b2.clear();
+    if (nEntriesThisGeneration == nEntriesPerGeneration) {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4) {
+            nGeneration = 1;
+        }
+        // Wipe the positions last set by the generation whose number is reused.
+        uint64_t nGenerationMask1 = -(uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = -(uint64_t)(nGeneration >> 1);
+        for (uint32_t p = 0; p < data.size(); p += 2) {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
     }
-    b1.insert(vKey);
-    b2.insert(vKey);
-    if (++nInsertions == nBloomSize) {
-        nInsertions = 0;
+    nEntriesThisGeneration++;
+
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = RollingBloomHash(n, nTweak, vKey);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        // The lowest bit of pos is ignored; the generation goes into both words of the pair.
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
     }
 }
 
@@ -251,10 +264,15 @@ void CRollingBloomFilter::insert(const uint256& hash)
 
 bool CRollingBloomFilter::contains(const std::vector<unsigned char>& vKey) const
 {
-    if (nInsertions < nBloomSize / 2) {
-        return b2.contains(vKey);
+    for (int n = 0; n < nHashFuncs; n++) {
+        uint32_t h = RollingBloomHash(n, nTweak, vKey);
+        int bit = h & 0x3F;
+        uint32_t pos = (h >> 6) % data.size();
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1)) {
+            return false;
+        }
     }
-    return b1.contains(vKey);
+    return true;
 }
 
 bool CRollingBloomFilter::contains(const uint256& hash) const
@@ -265,8 +283,87 @@ bool CRollingBloomFilter::contains(const uint256& hash) const
 
 void CRollingBloomFilter::reset()
 {
-    unsigned int nNewTweak = GetRand(std::numeric_limits<unsigned int>::max());
-    b1.reset(nNewTweak);
-    b2.reset(nNewTweak);
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
+
+/** 64-bit words in a block of a CBlockedBloomFilter: one cache line. */
+static const unsigned int BLOCKED_BLOOM_BLOCK_WORDS = 8;
+
+CBlockedBloomFilter::CBlockedBloomFilter(size_t nElements)
+{
+    reset(nElements);
+}
+
+void CBlockedBloomFilter::AddLayer(size_t nElements)
+{
+    Layer layer;
+    layer.nCapacity = std::max(nElements, (size_t)MIN_ELEMENTS);
+    size_t nBlocks = (layer.nCapacity * BITS_PER_ELEMENT + 511) / 512;
+    layer.vData.assign(nBlocks * BLOCKED_BLOOM_BLOCK_WORDS, 0);
+    layers.push_back(std::move(layer));
+    nLayerInsertions = 0;
+}
+
+/**
+ * The high 32 bits of the hash select the block, the low 32 bits the bits
+ * within it, using double hashing. The step is odd, so the probes of an
+ * element are distinct.
+ */
+static inline uint64_t* BlockedBloomProbe(const std::vector<uint64_t>& vData, uint64_t h, uint32_t& nBit, uint32_t& nStep)
+{
+    uint64_t nBlocks = vData.size() / BLOCKED_BLOOM_BLOCK_WORDS;
+    uint64_t nBlock = ((h >> 32) * nBlocks) >> 32;
+    nBit = (uint32_t)h;
+    nStep = (nBit >> 16) | 1;
+    return const_cast<uint64_t*>(&vData[nBlock * BLOCKED_BLOOM_BLOCK_WORDS]);
+}
+
+void CBlockedBloomFilter::insert(const uint256& hash)
+{
+    if (nLayerInsertions >= layers.back().nCapacity) {
+        AddLayer(layers.back().nCapacity * 2);
+    }
+    uint32_t nBit, nStep;
+    uint64_t* block = BlockedBloomProbe(layers.back().vData, hash.GetHash(salt), nBit, nStep);
+    for (unsigned int i = 0; i < NUM_PROBES; i++, nBit += nStep) {
+        block[(nBit >> 6) & 7] |= (uint64_t)1 << (nBit & 63);
+    }
+    nInsertions++;
+    nLayerInsertions++;
+}
+
+bool CBlockedBloomFilter::contains(const uint256& hash) const
+{
+    uint64_t h = hash.GetHash(salt);
+    for (const Layer& layer : layers) {
+        uint32_t nBit, nStep;
+        const uint64_t* block = BlockedBloomProbe(layer.vData, h, nBit, nStep);
+        bool fFound = true;
+        for (unsigned int i = 0; i < NUM_PROBES && fFound; i++, nBit += nStep) {
+            fFound = (block[(nBit >> 6) & 7] >> (nBit & 63)) & 1;
+        }
+        if (fFound)
+            return true;
+    }
+    return false;
+}
+
+void CBlockedBloomFilter::reset(size_t nElements)
+{
+    salt = GetRandHash();
+    layers.clear();
     nInsertions = 0;
+    AddLayer(nElements);
+}
+
+size_t CBlockedBloomFilter::DynamicMemoryUsage() const
+{
+    size_t usage = memusage::DynamicUsage(layers);
+    for (const Layer& layer : layers) {
+        usage += memusage::DynamicUsage(layer.vData);
+    }
+    return usage;
 }
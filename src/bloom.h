@@ -6,12 +6,12 @@
 #define BITCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
 
 //! 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -53,10 +53,6 @@ private:
 
     unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
 
-    // Private constructor for CRollingBloomFilter, no restrictions on size
-    CBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
-    friend class CRollingBloomFilter;
-
 public:
     /**
      * Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -89,7 +85,6 @@ public:
     bool contains(const uint256& hash) const;
 
     void clear();
-    void reset(unsigned int nNewTweak);
 
     //! True if the size is <= MAX_BLOOM_FILTER_SIZE and the number of hash functions is <= MAX_HASH_FUNCS
     //! (catch a filter which was just deserialized which was too big)
@@ -129,10 +124,63 @@ public:
     void reset();
 
 private:
-    unsigned int nBloomSize;
-    unsigned int nInsertions;
-    CBloomFilter b1, b2;
+    int nEntriesPerGeneration;
+    int nEntriesThisGeneration;
+    int nGeneration;
+    //! Two bits per position, holding the generation (1-3) that last set it, or 0
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    int nHashFuncs;
 };
 
+/**
+ * BlockedBloomFilter is a Bloom filter over 256-bit hashes that is split into
+ * 64-byte blocks. All bits of an element are in one block, so a lookup touches
+ * a single cache line. It is used to answer "definitely absent" for large
+ * on-disk sets without a database read.
+ *
+ * Once the filter holds the number of elements it was sized for, a new layer
+ * twice as large is added, which keeps the false positive rate bounded as the
+ * set grows. Elements cannot be removed; contains(item) always returns true if
+ * item was insert()'ed since the last reset().
+ */
+class CBlockedBloomFilter
+{
+public:
+    // Like CRollingBloomFilter, the salt is taken from GetRand() at creation
+    // time, so don't create global CBlockedBloomFilter objects.
+    explicit CBlockedBloomFilter(size_t nElements = 0);
+
+    void insert(const uint256& hash);
+    bool contains(const uint256& hash) const;
+
+    //! Remove all elements and resize the filter for nElements.
+    void reset(size_t nElements);
+
+    //! Number of elements inserted since the last reset.
+    size_t size() const { return nInsertions; }
+
+    size_t DynamicMemoryUsage() const;
+
+private:
+    //! Bits reserved per element, and how many of them an element sets.
+    //! This gives a false positive rate of about 0.2% per full layer.
+    static const unsigned int BITS_PER_ELEMENT = 16;
+    static const unsigned int NUM_PROBES = 8;
+    static const size_t MIN_ELEMENTS = 1024;
+
+    struct Layer {
+        std::vector<uint64_t> vData;
+        size_t nCapacity;
+    };
+
+    uint256 salt;
+    std::vector<Layer> layers;
+    size_t nInsertions;
+    //! Number of elements inserted into the last layer.
+    size_t nLayerInsertions;
+
+    void AddLayer(size_t nElements);
+};
 
 #endif // BITCOIN_BLOOM_H
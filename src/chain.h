@@ -235,8 +235,13 @@ public:
     unsigned int nTime;
     unsigned int nBits;
     uint256 nNonce;
+protected:
+    //! The Equihash solution. Once this entry is known to be stored in the
+    //! block tree database it is released with TrimSolution() to save memory,
+    //! and GetSolution() fetches it back on demand.
     std::vector<unsigned char> nSolution;
 
+public:
     //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
     uint32_t nSequenceId;
 
@@ -307,19 +312,28 @@ public:
         return ret;
     }
 
-    CBlockHeader GetBlockHeader() const
+    //! Get the block header for this block index. Requires cs_main.
+    CBlockHeader GetBlockHeader() const;
+
+    //! Get the Equihash solution, reading it back from the block tree
+    //! database if it has been trimmed. Requires cs_main.
+    std::vector<unsigned char> GetSolution() const;
+
+    bool HasSolution() const
     {
-        CBlockHeader block;
-        block.nVersion       = nVersion;
-        if (pprev)
-            block.hashPrevBlock = pprev->GetBlockHash();
-        block.hashMerkleRoot = hashMerkleRoot;
-        block.hashFinalSaplingRoot   = hashFinalSaplingRoot;
-        block.nTime          = nTime;
-        block.nBits          = nBits;
-        block.nNonce         = nNonce;
-        block.nSolution      = nSolution;
-        return block;
+        return !nSolution.empty();
+    }
+
+    void SetSolution(const std::vector<unsigned char>& solution)
+    {
+        nSolution = solution;
+    }
+
+    //! Release the in-memory Equihash solution. Only call this once the entry
+    //! is stored in the block tree database. Requires cs_main.
+    void TrimSolution()
+    {
+        std::vector<unsigned char>().swap(nSolution);
     }
 
     uint256 GetBlockHash() const
@@ -399,6 +413,13 @@ public:
 
     explicit CDiskBlockIndex(const CBlockIndex* pindex) : CBlockIndex(*pindex) {
         hashPrev = (pprev ? pprev->GetBlockHash() : uint256());
+        if (!HasSolution())
+            nSolution = pindex->GetSolution();
+    }
+
+    const std::vector<unsigned char>& GetSolution() const
+    {
+        return nSolution;
     }
 
     ADD_SERIALIZE_METHODS;
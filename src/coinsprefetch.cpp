@@ -0,0 +1,157 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "chain.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <boost/thread/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+CCoinsPrefetcher::CCoinsPrefetcher()
+{
+}
+
+void CCoinsPrefetcher::Schedule(const CBlockIndex* pindex)
+{
+    AssertLockHeld(cs_main);
+    Work work;
+    work.pindex = pindex;
+    work.nHeight = pindex->nHeight;
+    work.hash = pindex->GetBlockHash();
+    work.pos = pindex->GetBlockPos();
+    work.fTrustedHeader = pindex->IsValid(BLOCK_VALID_TREE);
+    // If it is unchanged when the block is connected, so is everything
+    // read for the block in between.
+    work.nGeneration = pcoinsdbview->GetWriteGeneration();
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (!setKnown.insert(pindex).second)
+        return;
+    queue.push_back(work);
+    cond.notify_one();
+}
+
+size_t CCoinsPrefetcher::Apply(const CBlockIndex* pindex, CCoinsViewCache& cache)
+{
+    std::unique_ptr<Result> result;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        std::map<const CBlockIndex*, std::unique_ptr<Result> >::iterator it = results.find(pindex);
+        if (it != results.end())
+            result = std::move(it->second);
+
+        // Blocks are connected in order, so nothing at or below this height
+        // is needed any more; that includes blocks of abandoned branches.
+        for (it = results.begin(); it != results.end();) {
+            if (it->second->nHeight <= pindex->nHeight) {
+                setKnown.erase(it->first);
+                results.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        // A block that is still queued or being read is not waited for;
+        // forgetting it makes the worker drop its result.
+        for (std::deque<Work>::iterator qit = queue.begin(); qit != queue.end();) {
+            if (qit->nHeight <= pindex->nHeight) {
+                setKnown.erase(qit->pindex);
+                qit = queue.erase(qit);
+            } else {
+                ++qit;
+            }
+        }
+        setKnown.erase(pindex);
+    }
+
+    if (!result || result->nGeneration != pcoinsdbview->GetWriteGeneration())
+        return 0;
+
+    size_t nAdded = 0;
+    for (std::pair<COutPoint, Coin>& entry : result->coins) {
+        if (cache.PrefillCoin(entry.first, std::move(entry.second)))
+            nAdded++;
+    }
+    LogPrint("bench", "    - Prefetched %u of %u inputs\n", (unsigned int)nAdded, (unsigned int)result->coins.size());
+    return nAdded;
+}
+
+void CCoinsPrefetcher::Fetch(const Work& work, const CCoinsViewDB& db, const Consensus::Params& params, Result& result)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, work.pos, work.hash, work.fTrustedHeader, params))
+        return;
+
+    // Outputs created within the block are not in the database yet.
+    boost::unordered_set<uint256, CCoinsKeyHasher> setBlockTxids;
+    for (const CTransaction& tx : block.vtx) {
+        setBlockTxids.insert(tx.GetHash());
+    }
+
+    for (const CTransaction& tx : block.vtx) {
+        boost::this_thread::interruption_point();
+        if (!tx.IsCoinBase()) {
+            for (const CTxIn& txin : tx.vin) {
+                if (setBlockTxids.count(txin.prevout.hash))
+                    continue;
+                Coin coin;
+                if (db.GetCoin(txin.prevout, coin))
+                    result.coins.push_back(std::make_pair(txin.prevout, std::move(coin)));
+            }
+        }
+        for (const JSDescription& joinsplit : tx.vJoinSplit) {
+            SproutMerkleTree tree;
+            db.GetSproutAnchorAt(joinsplit.anchor, tree);
+            for (const uint256& nf : joinsplit.nullifiers) {
+                db.GetNullifier(nf, SPROUT);
+            }
+        }
+        for (const SpendDescription& spend : tx.vShieldedSpend) {
+            SaplingMerkleTree tree;
+            db.GetSaplingAnchorAt(spend.anchor, tree);
+            db.GetNullifier(spend.nullifier, SAPLING);
+        }
+    }
+}
+
+void CCoinsPrefetcher::FetchNext(const Consensus::Params& params)
+{
+    Work work;
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (queue.empty())
+            cond.wait(lock);
+        work = queue.front();
+        queue.pop_front();
+    }
+
+    std::unique_ptr<Result> result(new Result());
+    result->nHeight = work.nHeight;
+    result->nGeneration = work.nGeneration;
+    try {
+        Fetch(work, *pcoinsdbview, params, *result);
+    } catch (const boost::thread_interrupted&) {
+        throw;
+    } catch (const std::exception& e) {
+        // Prefetching is only an optimization; the block is read again
+        // when it is connected.
+        LogPrintf("%s: %s\n", __func__, e.what());
+        result.reset();
+    }
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (result && setKnown.count(work.pindex))
+        results[work.pindex] = std::move(result);
+    else
+        setKnown.erase(work.pindex);
+}
+
+void CCoinsPrefetcher::Thread(const Consensus::Params& params)
+{
+    while (true)
+        FetchNext(params);
+}
@@ -0,0 +1,95 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSPREFETCH_H
+#define BITCOIN_COINSPREFETCH_H
+
+#include "chain.h"
+#include "coins.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+
+class CCoinsViewDB;
+
+namespace Consensus { struct Params; }
+
+/** Default for -prefetchthreads, the number of threads reading coins ahead of validation. */
+static const int DEFAULT_PREFETCH_THREADS = 2;
+/** Maximum number of -prefetchthreads. */
+static const int MAX_PREFETCH_THREADS = 8;
+/** How many blocks past the one being connected have their inputs read ahead. */
+static const int PREFETCH_BLOCKS_AHEAD = 8;
+
+/**
+ * Reads the inputs of blocks that are about to be connected from the coin
+ * database (pcoinsdbview) on worker threads, so that disk latency overlaps
+ * with validating the blocks before them.
+ *
+ * Workers look up every input of a scheduled block that is not created by
+ * the block itself, and the nullifiers and anchors of its shielded parts.
+ * Nullifier and anchor lookups only warm the database and its tree caches.
+ * The coins that were found are kept until the block is connected, and are
+ * then added to the cache it is connected on. Results are dropped if the
+ * database was written to since the block was queued, as they may be stale.
+ * Workers never access the block index; what they need is copied when the
+ * block is queued.
+ */
+class CCoinsPrefetcher
+{
+public:
+    CCoinsPrefetcher();
+
+    //! Queue a block whose data is on disk. Blocks already known are ignored.
+    //! Requires cs_main.
+    void Schedule(const CBlockIndex* pindex);
+
+    //! Add the coins read for pindex to cache, which must be backed by the
+    //! coin database without changes in between, and forget about pindex and
+    //! any block below it. Returns the number of coins added.
+    size_t Apply(const CBlockIndex* pindex, CCoinsViewCache& cache);
+
+    //! Read the next queued block, waiting until there is one.
+    void FetchNext(const Consensus::Params& params);
+
+    //! Worker loop; returns when the thread is interrupted.
+    void Thread(const Consensus::Params& params);
+
+private:
+    //! A queued block. pindex only identifies it.
+    struct Work {
+        const CBlockIndex* pindex;
+        int nHeight;
+        uint256 hash;
+        CDiskBlockPos pos;
+        bool fTrustedHeader;
+        //! Write generation of the coin database when the block was queued.
+        uint64_t nGeneration;
+    };
+
+    struct Result {
+        int nHeight;
+        uint64_t nGeneration;
+        std::vector<std::pair<COutPoint, Coin> > coins;
+    };
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    //! Blocks waiting for a worker.
+    std::deque<Work> queue;
+    //! Blocks queued, being read, or read and waiting to be applied.
+    std::set<const CBlockIndex*> setKnown;
+    std::map<const CBlockIndex*, std::unique_ptr<Result> > results;
+
+    void Fetch(const Work& work, const CCoinsViewDB& db, const Consensus::Params& params, Result& result);
+};
+
+#endif // BITCOIN_COINSPREFETCH_H
@@ -0,0 +1,343 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/blake2b.h"
+
+#include "crypto/common.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ENABLE_BLAKE2B_LANES 1
+#include <immintrin.h>
+#endif
+
+// Internal implementation code.
+namespace
+{
+/// Internal BLAKE2b implementation.
+namespace blake2b
+{
+const uint64_t IV[8] = {
+    0x6a09e667f3bcc908ull, 0xbb67ae8584caa73bull, 0x3c6ef372fe94f82bull, 0xa54ff53a5f1d36f1ull,
+    0x510e527fade682d1ull, 0x9b05688c2b3e6c1full, 0x1f83d9abfb41bd6bull, 0x5be0cd19137e2179ull,
+};
+
+const uint8_t SIGMA[12][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+    {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4},
+    {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+    {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13},
+    {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+    {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11},
+    {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+    {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5},
+    {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+};
+
+uint64_t inline Rotr(uint64_t x, int n) { return (x >> n) | (x << (64 - n)); }
+
+/** The BLAKE2b mixing function. */
+void inline G(uint64_t& a, uint64_t& b, uint64_t& c, uint64_t& d, uint64_t x, uint64_t y)
+{
+    a = a + b + x;
+    d = Rotr(d ^ a, 32);
+    c = c + d;
+    b = Rotr(b ^ c, 24);
+    a = a + b + y;
+    d = Rotr(d ^ a, 16);
+    c = c + d;
+    b = Rotr(b ^ c, 63);
+}
+
+/** Compress one 128-byte block into the chaining value h. */
+void Compress(uint64_t* h, const unsigned char* block, uint64_t t, bool last)
+{
+    uint64_t m[16];
+    uint64_t v[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = ReadLE64(block + 8 * i);
+    }
+    for (int i = 0; i < 8; i++) {
+        v[i] = h[i];
+        v[i + 8] = IV[i];
+    }
+    v[12] ^= t;
+    if (last) {
+        v[14] = ~v[14];
+    }
+    for (int r = 0; r < 12; r++) {
+        const uint8_t* s = SIGMA[r];
+        G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+        G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+        G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+        G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+        G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+        G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+        G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+        h[i] ^= v[i] ^ v[i + 8];
+    }
+}
+
+/** Write the first outlen bytes of the little-endian chaining value. */
+void inline Output(const uint64_t* h, unsigned char* out, size_t outlen)
+{
+    unsigned char full[64];
+    for (int i = 0; i < 8; i++) {
+        WriteLE64(full + 8 * i, h[i]);
+    }
+    memcpy(out, full, outlen);
+}
+
+/** Load the message words of the final block for one leaf index. */
+void inline LoadLeafBlock(uint64_t* m, const unsigned char* block, size_t pos, uint32_t index)
+{
+    unsigned char leaf[CBLAKE2bLeafHasher::BLOCK_SIZE];
+    memcpy(leaf, block, sizeof(leaf));
+    WriteLE32(leaf + pos, index);
+    for (int i = 0; i < 16; i++) {
+        m[i] = ReadLE64(leaf + 8 * i);
+    }
+}
+
+/**
+ * Finish a batch of leaf hashes whose final block is `block` with a
+ * little-endian index at offset pos. h is the midstate and t the total
+ * message length.
+ */
+typedef void (*LeafFunction)(const uint64_t* h, uint64_t t, const unsigned char* block, size_t pos,
+                             const uint32_t* indices, size_t count, unsigned char* out, size_t outlen);
+
+void LeafScalar(const uint64_t* h, uint64_t t, const unsigned char* block, size_t pos,
+                const uint32_t* indices, size_t count, unsigned char* out, size_t outlen)
+{
+    unsigned char leaf[CBLAKE2bLeafHasher::BLOCK_SIZE];
+    memcpy(leaf, block, sizeof(leaf));
+    for (size_t i = 0; i < count; i++) {
+        uint64_t s[8];
+        memcpy(s, h, sizeof(s));
+        WriteLE32(leaf + pos, indices[i]);
+        Compress(s, leaf, t, true);
+        Output(s, out + i * outlen, outlen);
+    }
+}
+
+#ifdef ENABLE_BLAKE2B_LANES
+/**
+ * The lane implementations keep word i of all lanes' state in one vector
+ * register, so each G is a handful of vertical 64-bit operations. The 16 and
+ * 24 bit rotations are byte shuffles, the 32 bit one a dword shuffle.
+ */
+#define BLAKE2B_LANE_ROUNDS(G)                                                  \
+    for (int r = 0; r < 12; r++) {                                             \
+        const uint8_t* s = SIGMA[r];                                           \
+        G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);                          \
+        G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);                          \
+        G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);                         \
+        G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);                         \
+        G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);                         \
+        G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);                       \
+        G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);                        \
+        G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);                        \
+    }
+
+#define BLAKE2B_G_SSE(a, b, c, d, x, y)                                         \
+    do {                                                                       \
+        a = _mm_add_epi64(_mm_add_epi64(a, b), x);                             \
+        d = _mm_shuffle_epi32(_mm_xor_si128(d, a), _MM_SHUFFLE(2, 3, 0, 1));   \
+        c = _mm_add_epi64(c, d);                                               \
+        b = _mm_shuffle_epi8(_mm_xor_si128(b, c), r24);                        \
+        a = _mm_add_epi64(_mm_add_epi64(a, b), y);                             \
+        d = _mm_shuffle_epi8(_mm_xor_si128(d, a), r16);                        \
+        c = _mm_add_epi64(c, d);                                               \
+        b = _mm_xor_si128(b, c);                                               \
+        b = _mm_or_si128(_mm_srli_epi64(b, 63), _mm_add_epi64(b, b));          \
+    } while (0)
+
+#define BLAKE2B_G_AVX2(a, b, c, d, x, y)                                        \
+    do {                                                                       \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), x);                       \
+        d = _mm256_shuffle_epi32(_mm256_xor_si256(d, a), _MM_SHUFFLE(2, 3, 0, 1)); \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = _mm256_shuffle_epi8(_mm256_xor_si256(b, c), r24);                  \
+        a = _mm256_add_epi64(_mm256_add_epi64(a, b), y);                       \
+        d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), r16);                  \
+        c = _mm256_add_epi64(c, d);                                            \
+        b = _mm256_xor_si256(b, c);                                            \
+        b = _mm256_or_si256(_mm256_srli_epi64(b, 63), _mm256_add_epi64(b, b)); \
+    } while (0)
+
+/** Two lanes per 128-bit register. */
+__attribute__((target("sse4.1")))
+void LeafSSE41(const uint64_t* h, uint64_t t, const unsigned char* block, size_t pos,
+               const uint32_t* indices, size_t count, unsigned char* out, size_t outlen)
+{
+    const __m128i r16 = _mm_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m128i r24 = _mm_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    for (size_t i = 0; i < count; i += 2) {
+        // Pad a trailing odd lane with a duplicate and drop its output.
+        uint32_t idx[2] = {indices[i], indices[i + 1 < count ? i + 1 : i]};
+        uint64_t w[2][16];
+        LoadLeafBlock(w[0], block, pos, idx[0]);
+        LoadLeafBlock(w[1], block, pos, idx[1]);
+        __m128i m[16];
+        __m128i v[16];
+        for (int j = 0; j < 16; j++) {
+            m[j] = _mm_set_epi64x(w[1][j], w[0][j]);
+        }
+        for (int j = 0; j < 8; j++) {
+            v[j] = _mm_set1_epi64x(h[j]);
+            v[j + 8] = _mm_set1_epi64x(IV[j]);
+        }
+        v[12] = _mm_set1_epi64x(IV[4] ^ t);
+        v[14] = _mm_set1_epi64x(~IV[6]);
+        BLAKE2B_LANE_ROUNDS(BLAKE2B_G_SSE)
+        uint64_t s[2][8];
+        for (int j = 0; j < 8; j++) {
+            uint64_t lanes[2];
+            _mm_storeu_si128((__m128i*)lanes, _mm_xor_si128(v[j], v[j + 8]));
+            s[0][j] = h[j] ^ lanes[0];
+            s[1][j] = h[j] ^ lanes[1];
+        }
+        for (size_t l = 0; l < 2 && i + l < count; l++) {
+            Output(s[l], out + (i + l) * outlen, outlen);
+        }
+    }
+}
+
+/** Four lanes per 256-bit register. */
+__attribute__((target("avx2")))
+void LeafAVX2(const uint64_t* h, uint64_t t, const unsigned char* block, size_t pos,
+              const uint32_t* indices, size_t count, unsigned char* out, size_t outlen)
+{
+    const __m256i r16 = _mm256_setr_epi8(2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9,
+                                         2, 3, 4, 5, 6, 7, 0, 1, 10, 11, 12, 13, 14, 15, 8, 9);
+    const __m256i r24 = _mm256_setr_epi8(3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10,
+                                         3, 4, 5, 6, 7, 0, 1, 2, 11, 12, 13, 14, 15, 8, 9, 10);
+    for (size_t i = 0; i < count; i += 4) {
+        // Pad a partial final batch with duplicates and drop their outputs.
+        uint64_t w[4][16];
+        for (size_t l = 0; l < 4; l++) {
+            LoadLeafBlock(w[l], block, pos, indices[i + l < count ? i + l : i]);
+        }
+        __m256i m[16];
+        __m256i v[16];
+        for (int j = 0; j < 16; j++) {
+            m[j] = _mm256_set_epi64x(w[3][j], w[2][j], w[1][j], w[0][j]);
+        }
+        for (int j = 0; j < 8; j++) {
+            v[j] = _mm256_set1_epi64x(h[j]);
+            v[j + 8] = _mm256_set1_epi64x(IV[j]);
+        }
+        v[12] = _mm256_set1_epi64x(IV[4] ^ t);
+        v[14] = _mm256_set1_epi64x(~IV[6]);
+        BLAKE2B_LANE_ROUNDS(BLAKE2B_G_AVX2)
+        uint64_t s[4][8];
+        for (int j = 0; j < 8; j++) {
+            uint64_t lanes[4];
+            _mm256_storeu_si256((__m256i*)lanes, _mm256_xor_si256(v[j], v[j + 8]));
+            for (int l = 0; l < 4; l++) {
+                s[l][j] = h[j] ^ lanes[l];
+            }
+        }
+        for (size_t l = 0; l < 4 && i + l < count; l++) {
+            Output(s[l], out + (i + l) * outlen, outlen);
+        }
+    }
+}
+
+#undef BLAKE2B_G_AVX2
+#undef BLAKE2B_G_SSE
+#undef BLAKE2B_LANE_ROUNDS
+#endif // ENABLE_BLAKE2B_LANES
+
+LeafFunction Leaf = LeafScalar;
+
+} // namespace blake2b
+} // namespace
+
+std::string BLAKE2bAutoDetect()
+{
+#ifdef ENABLE_BLAKE2B_LANES
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        blake2b::Leaf = blake2b::LeafAVX2;
+        return "avx2(4way)";
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        blake2b::Leaf = blake2b::LeafSSE41;
+        return "sse4.1(2way)";
+    }
+#endif
+    blake2b::Leaf = blake2b::LeafScalar;
+    return "standard";
+}
+
+////// CBLAKE2bLeafHasher
+
+CBLAKE2bLeafHasher::CBLAKE2bLeafHasher(size_t outlenIn, const unsigned char personal[PERSONAL_SIZE]) : t(0), buflen(0), outlen(outlenIn)
+{
+    assert(outlen > 0 && outlen <= MAX_OUTPUT_SIZE);
+    for (int i = 0; i < 8; i++) {
+        h[i] = blake2b::IV[i];
+    }
+    // Parameter block: digest length, no key, fanout 1, depth 1, no salt.
+    h[0] ^= 0x01010000ull ^ outlen;
+    h[6] ^= ReadLE64(personal);
+    h[7] ^= ReadLE64(personal + 8);
+    memset(buf, 0, sizeof(buf));
+}
+
+CBLAKE2bLeafHasher& CBLAKE2bLeafHasher::Write(const unsigned char* data, size_t len)
+{
+    while (len > 0) {
+        // The last block is only compressed on finalization, so a full
+        // buffer is flushed lazily once more input arrives.
+        if (buflen == BLOCK_SIZE) {
+            t += BLOCK_SIZE;
+            blake2b::Compress(h, buf, t, false);
+            buflen = 0;
+        }
+        size_t n = std::min(BLOCK_SIZE - buflen, len);
+        memcpy(buf + buflen, data, n);
+        buflen += n;
+        data += n;
+        len -= n;
+    }
+    return *this;
+}
+
+void CBLAKE2bLeafHasher::FinalizeOne(uint32_t index, unsigned char* out) const
+{
+    CBLAKE2bLeafHasher hasher(*this);
+    unsigned char le[4];
+    WriteLE32(le, index);
+    hasher.Write(le, sizeof(le));
+    memset(hasher.buf + hasher.buflen, 0, BLOCK_SIZE - hasher.buflen);
+    blake2b::Compress(hasher.h, hasher.buf, hasher.t + hasher.buflen, true);
+    blake2b::Output(hasher.h, out, outlen);
+}
+
+void CBLAKE2bLeafHasher::Finalize(const uint32_t* indices, size_t count, unsigned char* out) const
+{
+    if (buflen + 4 > BLOCK_SIZE) {
+        // The index straddles two blocks; there is no shared midstate to batch from.
+        for (size_t i = 0; i < count; i++) {
+            FinalizeOne(indices[i], out + i * outlen);
+        }
+        return;
+    }
+    unsigned char block[BLOCK_SIZE];
+    memcpy(block, buf, buflen);
+    memset(block + buflen, 0, BLOCK_SIZE - buflen);
+    blake2b::Leaf(h, t + buflen + 4, block, buflen, indices, count, out, outlen);
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_BLAKE2B_H
+#define BITCOIN_CRYPTO_BLAKE2B_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+
+/** A personalised, unkeyed BLAKE2b hasher specialised for Equihash leaf hashes.
+ *
+ * Every leaf hash of an Equihash solution is BLAKE2b(I||V||le32(index)) with a
+ * common prefix I||V. This class absorbs the prefix once and then finishes any
+ * number of indices in a batch, several at a time on CPUs with SSE4.1 or AVX2.
+ * Output is byte-for-byte identical to libsodium's crypto_generichash_blake2b.
+ */
+class CBLAKE2bLeafHasher
+{
+public:
+    static const size_t BLOCK_SIZE = 128;
+    static const size_t PERSONAL_SIZE = 16;
+    static const size_t MAX_OUTPUT_SIZE = 64;
+
+    CBLAKE2bLeafHasher(size_t outlenIn, const unsigned char personal[PERSONAL_SIZE]);
+    CBLAKE2bLeafHasher& Write(const unsigned char* data, size_t len);
+
+    /** Write the hash of prefix||le32(indices[i]) to out + i*outlen, for i < count. */
+    void Finalize(const uint32_t* indices, size_t count, unsigned char* out) const;
+
+private:
+    uint64_t h[8];
+    uint64_t t;
+    unsigned char buf[BLOCK_SIZE];
+    size_t buflen;
+    size_t outlen;
+
+    void FinalizeOne(uint32_t index, unsigned char* out) const;
+};
+
+/** Autodetect the best available BLAKE2b lane implementation.
+ *  Returns the name of the implementation. */
+std::string BLAKE2bAutoDetect();
+
+#endif // BITCOIN_CRYPTO_BLAKE2B_H
@@ -18,6 +18,7 @@
 #endif
 
 #include "compat/endian.h"
+#include "crypto/blake2b.h"
 #include "crypto/equihash.h"
 #include "util.h"
 
@@ -29,18 +30,25 @@
 
 static EhSolverCancelledException solver_cancelled;
 
-template<unsigned int N, unsigned int K>
-int Equihash<N,K>::InitialiseState(eh_HashState& base_state)
+static void EhPersonalization(unsigned int N, unsigned int K,
+                              unsigned char personalization[crypto_generichash_blake2b_PERSONALBYTES])
 {
     uint32_t le_N = htole32(N);
     uint32_t le_K = htole32(K);
-    unsigned char personalization[crypto_generichash_blake2b_PERSONALBYTES] = {};
+    memset(personalization, 0, crypto_generichash_blake2b_PERSONALBYTES);
     if ((N==144 && K==5) || (N==125 && K==4))
         memcpy(personalization, "ZelProof", 8);
     else
         memcpy(personalization, "ZcashPoW", 8);
     memcpy(personalization+8,  &le_N, 4);
     memcpy(personalization+12, &le_K, 4);
+}
+
+template<unsigned int N, unsigned int K>
+int Equihash<N,K>::InitialiseState(eh_HashState& base_state)
+{
+    unsigned char personalization[crypto_generichash_blake2b_PERSONALBYTES];
+    EhPersonalization(N, K, personalization);
     return crypto_generichash_blake2b_init_salt_personal(&base_state,
                                                          NULL, 0, // No key.
                                                          (512/N)*((N+7)/8),
@@ -87,6 +95,24 @@ void GenerateHash(const eh_HashState& base_state, eh_index g,
     }
 }
 
+// Combine the consecutive hashes of the indices g & ~15 up to g into the
+// twisted hash of g, exactly as GenerateHash does one index at a time.
+static void CombineTwistHashes(const unsigned char* hashes, size_t count,
+                               unsigned char* hash, size_t hLen)
+{
+    uint32_t myHash[16] = {0};
+    for (size_t n = 0; n < count; n++) {
+        uint32_t tmpHash[16] = {0};
+        memcpy(tmpHash, hashes + n*hLen, hLen);
+        for (uint32_t idx = 0; idx < 16; idx++) myHash[idx] += tmpHash[idx];
+    }
+
+    uint8_t * hashBytes = (uint8_t *) &myHash[0];
+    for (uint32_t i=15; i<hLen; i+=16) hashBytes[i] &= 0xF8;
+
+    memcpy(hash, &myHash[0], hLen);
+}
+
 void ExpandArray(const unsigned char* in, size_t in_len,
                  unsigned char* out, size_t out_len,
                  size_t bit_len, size_t byte_pad)
@@ -781,6 +807,64 @@ bool Equihash<N,K>::IsValidSolution(const eh_HashState& base_state, std::vector<
                        ((N+7)/8), HashLength, CollisionBitLength, i);
     }
 
+    return IsValidSolutionTree(X);
+}
+
+template<unsigned int N, unsigned int K>
+bool Equihash<N,K>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln)
+{
+    if (soln.size() != SolutionWidth) {
+        LogPrint("pow", "Invalid solution length: %d (expected %d)\n",
+                 soln.size(), SolutionWidth);
+        return false;
+    }
+
+    bool twist = ((N == 125) && (K ==4));
+
+    // Collect every distinct hash index the solution needs (including the
+    // prefixes of each twisted group), so that each BLAKE2b output is computed
+    // once and the whole set is finished in multi-lane batches.
+    std::vector<eh_index> indices = GetIndicesFromMinimal(soln, CollisionBitLength);
+    std::vector<eh_index> hashIndices;
+    for (eh_index i : indices) {
+        eh_index g = i/IndicesPerHashOutput;
+        for (eh_index g2 = twist ? (g & 0xFFFFFFF0) : g; g2 <= g; g2++) {
+            hashIndices.push_back(g2);
+        }
+    }
+    std::sort(hashIndices.begin(), hashIndices.end());
+    hashIndices.erase(std::unique(hashIndices.begin(), hashIndices.end()), hashIndices.end());
+
+    unsigned char personalization[crypto_generichash_blake2b_PERSONALBYTES];
+    EhPersonalization(N, K, personalization);
+    CBLAKE2bLeafHasher hasher(HashOutput, personalization);
+    hasher.Write(input, inputLen);
+    std::vector<unsigned char> hashes(hashIndices.size() * HashOutput);
+    hasher.Finalize(hashIndices.data(), hashIndices.size(), hashes.data());
+
+    std::vector<FullStepRow<FinalFullWidth>> X;
+    X.reserve(1 << K);
+    unsigned char tmpHash[HashOutput];
+    for (eh_index i : indices) {
+        eh_index g = i/IndicesPerHashOutput;
+        size_t pos = std::lower_bound(hashIndices.begin(), hashIndices.end(), g) - hashIndices.begin();
+        if (twist) {
+            // The whole group g & ~15 .. g is present and contiguous.
+            size_t count = (g & 0xF) + 1;
+            CombineTwistHashes(&hashes[(pos + 1 - count) * HashOutput], count, tmpHash, HashOutput);
+        } else {
+            memcpy(tmpHash, &hashes[pos * HashOutput], HashOutput);
+        }
+        X.emplace_back(tmpHash+((i % IndicesPerHashOutput) * ((N+7)/8)),
+                       ((N+7)/8), HashLength, CollisionBitLength, i);
+    }
+
+    return IsValidSolutionTree(X);
+}
+
+template<unsigned int N, unsigned int K>
+bool Equihash<N,K>::IsValidSolutionTree(std::vector<FullStepRow<FinalFullWidth>> X)
+{
     size_t hashLen = HashLength;
     size_t lenIndices = sizeof(eh_index);
     while (X.size() > 1) {
@@ -822,6 +906,7 @@ template bool Equihash<96,3>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<96,3>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,3>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<144,5>
 template int Equihash<144,5>::InitialiseState(eh_HashState& base_state);
@@ -834,6 +919,7 @@ template bool Equihash<144,5>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<144,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<144,5>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
 
 // Explicit instantiations for ZelHash
 template int Equihash<125,4>::InitialiseState(eh_HashState& base_state);
@@ -846,6 +932,7 @@ template bool Equihash<125,4>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<125,4>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<125,4>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<200,9>
 template int Equihash<200,9>::InitialiseState(eh_HashState& base_state);
@@ -858,6 +945,7 @@ template bool Equihash<200,9>::OptimisedSolve(const eh_HashState& base_state,
                                               const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<200,9>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<200,9>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<96,5>
 template int Equihash<96,5>::InitialiseState(eh_HashState& base_state);
@@ -870,6 +958,7 @@ template bool Equihash<96,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<96,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<96,5>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
 
 // Explicit instantiations for Equihash<48,5>
 template int Equihash<48,5>::InitialiseState(eh_HashState& base_state);
@@ -882,3 +971,4 @@ template bool Equihash<48,5>::OptimisedSolve(const eh_HashState& base_state,
                                              const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
 template bool Equihash<48,5>::IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+template bool Equihash<48,5>::IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
@@ -190,6 +190,11 @@ public:
                         const std::function<bool(EhSolverCancelCheck)> cancelled);
 #endif
     bool IsValidSolution(const eh_HashState& base_state, std::vector<unsigned char> soln);
+    /** Same as above, but hashes the leaves of I||V in multi-lane batches. */
+    bool IsValidSolution(const unsigned char* input, size_t inputLen, std::vector<unsigned char> soln);
+
+private:
+    bool IsValidSolutionTree(std::vector<FullStepRow<FinalFullWidth>> X);
 };
 
 #include "equihash.tcc"
@@ -293,4 +298,21 @@ inline bool EhOptimisedSolveUncancellable(unsigned int n, unsigned int k, const
         throw std::invalid_argument("Unsupported Equihash parameters"); \
     }
 
+#define EhIsValidSolutionForInput(n, k, input, inputLen, soln, ret)     \
+    if (n == 96 && k == 3) {                                            \
+        ret = Eh96_3.IsValidSolution(input, inputLen, soln);            \
+    } else if (n == 144 && k == 5) {                                    \
+        ret = Eh144_5.IsValidSolution(input, inputLen, soln);           \
+    } else if (n == 125 && k == 4) {                                    \
+        ret = Eh125_4.IsValidSolution(input, inputLen, soln);           \
+    } else if (n == 200 && k == 9) {                                    \
+        ret = Eh200_9.IsValidSolution(input, inputLen, soln);           \
+    } else if (n == 96 && k == 5) {                                     \
+        ret = Eh96_5.IsValidSolution(input, inputLen, soln);            \
+    } else if (n == 48 && k == 5) {                                     \
+        ret = Eh48_5.IsValidSolution(input, inputLen, soln);            \
+    } else {                                                            \
+        throw std::invalid_argument("Unsupported Equihash parameters"); \
+    }
+
 #endif // BITCOIN_EQUIHASH_H
@@ -0,0 +1,82 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+// SHA-256 transform using the Intel SHA extensions.
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+
+#include <immintrin.h>
+
+namespace sha256_shani
+{
+namespace
+{
+const uint32_t K[64] __attribute__((aligned(16))) = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+const unsigned char MASK[16] __attribute__((aligned(16))) = {
+    0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04, 0x0b, 0x0a, 0x09, 0x08, 0x0f, 0x0e, 0x0d, 0x0c,
+};
+} // namespace
+
+/**
+ * Perform a number of SHA-256 transformations, processing 64-byte chunks.
+ *
+ * The SHA instructions keep the state as ABEF/CDGH register pairs and run
+ * two rounds per sha256rnds2, so a block is sixteen groups of four rounds
+ * with the message schedule extended by sha256msg1/sha256msg2.
+ */
+__attribute__((target("sse4.1,sha")))
+void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks)
+{
+    const __m128i mask = _mm_load_si128((const __m128i*)MASK);
+
+    // Load state and rearrange from ABCD/EFGH into ABEF/CDGH.
+    __m128i t1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)s), 0xB1);
+    __m128i t2 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(s + 4)), 0x1B);
+    __m128i s0 = _mm_alignr_epi8(t1, t2, 8);
+    __m128i s1 = _mm_blend_epi16(t2, t1, 0xF0);
+
+    while (blocks--) {
+        const __m128i so0 = s0;
+        const __m128i so1 = s1;
+        __m128i m[4];
+        for (int q = 0; q < 16; q++) {
+            if (q < 4) {
+                m[q] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(chunk + 16 * q)), mask);
+            } else {
+                // W[t] = sigma1(W[t-2]) + W[t-7] + sigma0(W[t-15]) + W[t-16], four at a time.
+                __m128i w = _mm_sha256msg1_epu32(m[q & 3], m[(q + 1) & 3]);
+                w = _mm_add_epi32(w, _mm_alignr_epi8(m[(q + 3) & 3], m[(q + 2) & 3], 4));
+                m[q & 3] = _mm_sha256msg2_epu32(w, m[(q + 3) & 3]);
+            }
+            const __m128i msg = _mm_add_epi32(m[q & 3], _mm_load_si128((const __m128i*)(K + 4 * q)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0E));
+        }
+        s0 = _mm_add_epi32(s0, so0);
+        s1 = _mm_add_epi32(s1, so1);
+        chunk += 64;
+    }
+
+    // Rearrange back into ABCD/EFGH and store.
+    t1 = _mm_shuffle_epi32(s0, 0x1B);
+    t2 = _mm_shuffle_epi32(s1, 0xB1);
+    _mm_storeu_si128((__m128i*)s, _mm_blend_epi16(t1, t2, 0xF0));
+    _mm_storeu_si128((__m128i*)(s + 4), _mm_alignr_epi8(t2, t1, 8));
+}
+} // namespace sha256_shani
+
+#endif
@@ -217,6 +217,23 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
 
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
+/** SipHash-2-4, keyed with (k0, k1), over a sequence of 64-bit words. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    CSipHasher(uint64_t k0, uint64_t k1);
+    //! Hash a 64-bit integer, as its 8 little-endian bytes.
+    CSipHasher& Write(uint64_t data);
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of a uint256 with key (k0, k1); equivalent to writing its four words to a CSipHasher. */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 void BIP32Hash(const ChainCode &chainCode, unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
 
 #endif // BITCOIN_HASH_H
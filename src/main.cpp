@@ -10,18 +10,23 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
+#include "crypto/common.h"
 #include "deprecation.h"
 #include "init.h"
+#include "mappedfile.h"
 #include "merkleblock.h"
 #include "metrics.h"
 #include "net.h"
 #include "pow.h"
 #include "txmempool.h"
+#include "txvalidationcache.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -68,6 +73,8 @@ static int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nPrefetchThreads = 0;
+int nTxCheckThreads = 0;
 bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
@@ -115,6 +122,18 @@ static void CheckBlockIndex(const Consensus::Params& consensusParams);
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
 
+/** Script verification flags enforced by ConnectBlock. DERSIG (BIP66) is also always enforced, but does not have a flag. */
+static const unsigned int BLOCK_SCRIPT_VERIFY_FLAGS = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+
+/**
+ * Returns true if the scripts, JoinSplit proofs and Sapling proofs of tx were
+ * already fully verified under the given consensus branch, at mempool acceptance.
+ */
+static bool IsTxValidated(const CTransaction& tx, uint32_t consensusBranchId)
+{
+    return txValidationCache.Get(txValidationCache.ComputeEntry(tx.GetHash(), BLOCK_SCRIPT_VERIFY_FLAGS, consensusBranchId));
+}
+
 const string strMessageMagic = "Zelcash Signed Message:\n";
 
 
@@ -229,6 +248,7 @@ namespace {
         int64_t nTime;           //!< Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //!< The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock; //!< Optional, used for cmpctblock downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -238,6 +258,16 @@ namespace {
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
+    /** Peers we asked to announce new blocks with cmpctblock messages, oldest first. Protected by cs_main. */
+    std::list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /**
+     * The "cmpctblock" message for the most recent tip we announced or served,
+     * if any, shared by all peers it is sent to. Protected by cs_main.
+     */
+    uint256 hashMostRecentCompactBlock;
+    std::shared_ptr<const CSerializeData> mostRecentCompactBlockMessage;
+
     /** Dirty block index entries. */
     set<CBlockIndex*> setDirtyBlockIndex;
 
@@ -290,8 +320,28 @@ struct CNodeState {
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     int nBlocksInFlightValidHeaders;
+    //! Moving average of the time (in microseconds) this peer spends per block we request, or 0 if not known yet.
+    int64_t nBlockServiceTime;
+    //! Moving average of the time (in microseconds) from requesting a block from this peer to receiving it, or 0.
+    int64_t nBlockLatency;
+    //! When the last block requested from this peer arrived (in microseconds), or 0.
+    int64_t nLastBlockReceived;
+    //! Number of blocks requested from this peer that it delivered.
+    int nBlocksDownloaded;
+    //! Number of blocks requested from this peer that were requested from another peer as it stalled.
+    int nBlocksStalled;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Whether this peer wants new blocks announced with a headers message rather than an inv.
+    bool fPreferHeaders;
+    //! Whether this peer wants new blocks announced with a cmpctblock rather than an inv.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer can send us cmpctblocks, if we request them.
+    bool fProvidesHeaderAndIDs;
+    //! Block announcements from this peer in a row that did not connect to our headers.
+    int nUnconnectingHeaders;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -304,7 +354,17 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
+        nBlockServiceTime = 0;
+        nBlockLatency = 0;
+        nLastBlockReceived = 0;
+        nBlocksDownloaded = 0;
+        nBlocksStalled = 0;
         fPreferredDownload = false;
+        pindexBestHeaderSent = NULL;
+        fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        nUnconnectingHeaders = 0;
     }
 };
 
@@ -363,16 +423,35 @@ void FinalizeNode(NodeId nodeid) {
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
+/** Add a sample to a moving average of times, in microseconds. */
+void UpdateAverageTime(int64_t& nAverage, int64_t nSample) {
+    nAverage = nAverage == 0 ? std::max<int64_t>(nSample, 1) : std::max<int64_t>((nAverage * 7 + nSample) / 8, 1);
+}
+
 // Requires cs_main.
-// Returns a bool indicating whether we requested this block.
-bool MarkBlockAsReceived(const uint256& hash) {
+// Returns a bool indicating whether we requested this block. nodeFrom, if
+// given, is the peer that delivered it, whose download rate is updated if
+// the block was requested from it.
+bool MarkBlockAsReceived(const uint256& hash, NodeId nodeFrom = -1) {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
         CNodeState *state = State(itInFlight->second.first);
+        if (nodeFrom == itInFlight->second.first) {
+            // The peer works on the blocks we request in turn, so the time
+            // it spent on this one starts when it was requested, or when the
+            // previous one arrived if that is later.
+            int64_t nNow = GetTimeMicros();
+            int64_t nRequested = itInFlight->second.second->nTime;
+            UpdateAverageTime(state->nBlockServiceTime, nNow - std::max(nRequested, state->nLastBlockReceived));
+            UpdateAverageTime(state->nBlockLatency, nNow - nRequested);
+            state->nLastBlockReceived = nNow;
+            state->nBlocksDownloaded++;
+        }
         nQueuedValidatedHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->nBlocksInFlightValidHeaders -= itInFlight->second.second->fValidatedHeaders;
         state->vBlocksInFlight.erase(itInFlight->second.second);
@@ -385,20 +464,80 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from the same peer, which
+// is left as it is. pit, if given, is set to the entry of the block.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it is from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
-    nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(),
+            {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams), std::unique_ptr<PartiallyDownloadedBlock>()});
+    nQueuedValidatedHeaders += it->fValidatedHeaders;
     state->nBlocksInFlight++;
-    state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    state->nBlocksInFlightValidHeaders += it->fValidatedHeaders;
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
+}
+
+/**
+ * Ask a peer that just gave us a new block to announce the next ones with a
+ * cmpctblock ("high-bandwidth" mode, saving the getdata round-trip). At most
+ * three peers are asked at a time; the one asked longest ago is told to stop.
+ * Requires cs_main.
+ */
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    for (std::list<NodeId>::iterator it = lNodesAnnouncingHeaderAndIDs.begin(); it != lNodesAnnouncingHeaderAndIDs.end(); it++) {
+        if (*it == pfrom->GetId()) {
+            lNodesAnnouncingHeaderAndIDs.erase(it);
+            lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+            return;
+        }
+    }
+    const uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == lNodesAnnouncingHeaderAndIDs.front()) {
+                pnode->PushMessage("sendcmpct", false, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+    }
+    pfrom->PushMessage("sendcmpct", true, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+/** Whether we are close enough to the tip to fetch announced blocks directly. Requires cs_main. */
+bool CanDirectFetch(const Consensus::Params& consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
+/** Whether the peer has the header of pindex, as far as we know. Requires cs_main. */
+bool PeerHasHeader(const CNodeState* state, const CBlockIndex* pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -454,8 +593,9 @@ CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
 }
 
 /** Update pindexLastCommonBlock and add not-in-flight missing successors to vBlocks, until it has
- *  at most count entries. */
-void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller) {
+ *  at most count entries. If nothing can be fetched because another peer holds up the download window,
+ *  nodeStaller is set to that peer and pindexStalled to the block it holds it up with. */
+void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller, CBlockIndex*& pindexStalled) {
     if (count == 0)
         return;
 
@@ -491,6 +631,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
     int nWindowEnd = state->pindexLastCommonBlock->nHeight + BLOCK_DOWNLOAD_WINDOW;
     int nMaxHeight = std::min<int>(state->pindexBestKnownBlock->nHeight, nWindowEnd + 1);
     NodeId waitingfor = -1;
+    CBlockIndex* pindexWaitingFor = NULL;
     while (pindexWalk->nHeight < nMaxHeight) {
         // Read up to 128 (or more, if more blocks than that are needed) successors of pindexWalk (towards
         // pindexBestKnownBlock) into vToFetch. We fetch 128, because CBlockIndex::GetAncestor may be as expensive
@@ -522,6 +663,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                     if (vBlocks.size() == 0 && waitingfor != nodeid) {
                         // We aren't able to fetch anything, but we would be if the download window was one larger.
                         nodeStaller = waitingfor;
+                        pindexStalled = pindexWaitingFor;
                     }
                     return;
                 }
@@ -532,6 +674,7 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
             } else if (waitingfor == -1) {
                 // This is the first already-in-flight block.
                 waitingfor = mapBlocksInFlight[pindex->GetBlockHash()].first;
+                pindexWaitingFor = pindex;
             }
         }
     }
@@ -551,9 +694,21 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.nBlocksInFlightQuota = GetBlockDownloadQuota(state->nBlockServiceTime);
+    stats.nBlocksDownloaded = state->nBlocksDownloaded;
+    stats.nBlocksStalled = state->nBlocksStalled;
+    stats.nBlockServiceTime = state->nBlockServiceTime;
+    stats.nBlockLatency = state->nBlockLatency;
     return true;
 }
 
+int GetBlockDownloadQuota(int64_t nBlockServiceTime) {
+    if (nBlockServiceTime <= 0)
+        return MAX_BLOCKS_IN_TRANSIT_PER_PEER;
+    int64_t nQuota = (1000000LL * BLOCK_DOWNLOAD_QUEUE_TIME + nBlockServiceTime - 1) / nBlockServiceTime;
+    return std::max<int64_t>(MIN_BLOCKS_IN_TRANSIT_PER_PEER, std::min<int64_t>(nQuota, MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER));
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
@@ -590,6 +745,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 CDeterministicZelnodeDB* pZelnodeDB = NULL;
@@ -902,6 +1058,76 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+/**
+ * Verify the Sapling spend descriptions, output descriptions and binding
+ * signature of a transaction. On failure strError and strRejectReason describe
+ * the first check that failed.
+ */
+static bool CheckSaplingProofs(const CTransaction& tx, const uint256& dataToBeSigned,
+                               std::string& strError, std::string& strRejectReason)
+{
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : tx.vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strError = "Sapling spend description invalid";
+            strRejectReason = "bad-txns-sapling-spend-description-invalid";
+            return false;
+        }
+    }
+
+    for (const OutputDescription &output : tx.vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strError = "Sapling output description invalid";
+            strRejectReason = "bad-txns-sapling-output-description-invalid";
+            return false;
+        }
+    }
+
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        tx.valueBalance,
+        tx.bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
+        librustzcash_sapling_verification_ctx_free(ctx);
+        strError = "Sapling binding signature invalid";
+        strRejectReason = "bad-txns-sapling-binding-signature-invalid";
+        return false;
+    }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    return true;
+}
+
+bool CSaplingCheck::operator()() {
+    std::string strError, strRejectReason;
+    if (!CheckSaplingProofs(*ptx, dataToBeSigned, strError, strRejectReason)) {
+        return ::error("CSaplingCheck(): %s: %s", ptx->GetHash().ToString(), strError);
+    }
+    return true;
+}
+
 /**
  * Check a transaction contextually against a set of consensus rules valid at a given block height.
  *
@@ -919,7 +1145,8 @@ bool ContextualCheckTransaction(
         const int dosLevel,
         bool fFromAccept,
         bool fFromMempool,
-        bool (*isInitBlockDownload)(const CChainParams&))
+        bool (*isInitBlockDownload)(const CChainParams&),
+        std::vector<CSaplingCheck> *pvSaplingChecks)
 {
     bool saplingActive = NetworkUpgradeActive(nHeight, chainparams.GetConsensus(), Consensus::UPGRADE_ACADIA);
     bool isSprout = !saplingActive;
@@ -1100,54 +1327,15 @@ bool ContextualCheckTransaction(
     if (!tx.vShieldedSpend.empty() ||
         !tx.vShieldedOutput.empty())
     {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
-        }
-
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
+        if (pvSaplingChecks) {
+            pvSaplingChecks->push_back(CSaplingCheck(tx, dataToBeSigned));
+        } else {
+            std::string strError, strRejectReason;
+            if (!CheckSaplingProofs(tx, dataToBeSigned, strError, strRejectReason)) {
+                return state.DoS(100, error("ContextualCheckTransaction(): %s", strError),
+                                      REJECT_INVALID, strRejectReason);
             }
         }
-
-        if (!librustzcash_sapling_final_check(
-            ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
-            dataToBeSigned.begin()
-        ))
-        {
-            librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
-        }
-
-        librustzcash_sapling_verification_ctx_free(ctx);
     }
 
     if (tx.IsZelnodeTx()) {
@@ -1169,24 +1357,19 @@ bool ContextualCheckTransaction(
                 COutPoint outPoint = tx.collateralOut;
                 CPubKey userpubkey = tx.collateralPubkey;
 
-                CCoins coins;
-                if (!pcoinsTip->GetCoins(outPoint.hash, coins)) {
-                    fFailure = true;
-                    strFailMessage = "zelnode-tx-coins-not-found";
-                }
-
-                if (!fFailure && !coins.IsAvailable(outPoint.n)) {
+                Coin coin;
+                if (!pcoinsTip->GetCoin(outPoint, coin)) {
                     fFailure = true;
                     strFailMessage = "zelnode-tx-coins-not-available";
                 }
 
                 CTxDestination destination;
-                if (!fFailure && !ExtractDestination(coins.vout[outPoint.n].scriptPubKey, destination)) {
+                if (!fFailure && !ExtractDestination(coin.out.scriptPubKey, destination)) {
                     fFailure = true;
                     strFailMessage = "zelnode-tx-failed-to-extract-destination";
                 }
 
-                if (!fFailure && coins.vout[outPoint.n].scriptPubKey.IsPayToScriptHash()) {
+                if (!fFailure && coin.out.scriptPubKey.IsPayToScriptHash()) {
                     // Here we have a node of which the collatoral is stored in a multisig address.
                     // Only the flux foundation can do this. So lets use the chainparams public key to verify the signature
                     // This means that the userpubkey is unable to be the same as the destination
@@ -1621,7 +1804,13 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 
 
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fProofsChecked)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee, fProofsChecked);
+}
+
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee, bool fProofsChecked)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1675,13 +1864,15 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
-    auto verifier = libzelcash::ProofVerifier::Strict();
+    auto verifier = fProofsChecked ? libzelcash::ProofVerifier::Disabled() : libzelcash::ProofVerifier::Strict();
     if (!CheckTransaction(tx, state, verifier))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
     // DoS level set to 10 to be more forgiving.
     // Check transaction contextually against the set of consensus rules which apply in the next block to be mined.
-    if (!ContextualCheckTransaction(tx, state, Params(), nextBlockHeight, 10, false, true)) {
+    std::vector<CSaplingCheck> vSkippedSaplingChecks;
+    if (!ContextualCheckTransaction(tx, state, Params(), nextBlockHeight, 10, false, true, IsInitialBlockDownload,
+                                    fProofsChecked ? &vSkippedSaplingChecks : NULL)) {
         return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
     }
 
@@ -1786,8 +1977,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         view.SetBackend(viewMemPool);
 
         // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
+        for (size_t out = 0; out < tx.vout.size(); out++) {
+            if (view.HaveCoin(COutPoint(hash, out)))
+                return false;
+        }
 
         if (tx.IsZelnodeTx()) {
             if (tx.nType == ZELNODE_START_TX_TYPE) {
@@ -1807,10 +2000,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
+        // Note that a spent input cannot be told apart from a missing one, so
+        // both are reported through pfMissingInputs.
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!view.HaveCoin(txin.prevout)) {
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1861,8 +2054,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1873,7 +2066,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // it has passed ContextualCheckInputs and therefore this is correct.
         auto consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx), fSpendsCoinbase, consensusBranchId);
         unsigned int nSize = entry.GetTxSize();
 
         // Accept a tx if it contains joinsplits and has at least the default fee specified by z_sendmany.
@@ -1947,6 +2140,16 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
 
+        // Check once more against the flags used when connecting blocks (this
+        // is cheap, as the signatures are now in the signature cache) and
+        // remember that the scripts and proofs of this transaction have been
+        // fully verified, so that connecting a block containing it can skip them.
+        if (!ContextualCheckInputs(tx, state, view, true, BLOCK_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), consensusBranchId))
+        {
+            return error("AcceptToMemoryPool: BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s", hash.ToString());
+        }
+        txValidationCache.Set(txValidationCache.ComputeEntry(hash, BLOCK_SCRIPT_VERIFY_FLAGS, consensusBranchId));
+
         {
             // We lock to prevent other threads from accessing the mempool between adding and evicting
             LOCK(pool.cs);
@@ -2051,14 +2254,16 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
             view.SetBackend(viewMemPool);
 
             // do we already have it?
-            if (view.HaveCoins(hash))
-                return false;
+            for (size_t out = 0; out < tx.vout.size(); out++) {
+                if (view.HaveCoin(COutPoint(hash, out)))
+                    return false;
+            }
 
             // do all inputs exist?
-            // Note that this does not check for the presence of actual outputs (see the next check for that),
-            // only helps filling in pfMissingInputs (to determine missing vs spent).
+            // Note that a spent input cannot be told apart from a missing one, so
+            // both are reported through pfMissingInputs.
             for (const CTxIn& txin : tx.vin) {
-                if (!view.HaveCoins(txin.prevout.hash)) {
+                if (!view.HaveCoin(txin.prevout)) {
                     if (pfMissingInputs)
                         *pfMissingInputs = true;
                     return false;
@@ -2108,8 +2313,8 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -2287,10 +2492,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, const Consensus::P
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
         int nHeight = -1;
         {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
+            const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+            if (!coin.IsSpent())
+                nHeight = coin.nHeight;
         }
         if (nHeight > 0)
             pindexSlow = chainActive[nHeight];
@@ -2343,10 +2547,254 @@ bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHea
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+namespace {
+
+/**
+ * Small LRU of Equihash solutions read back from the block tree database for
+ * block index entries whose in-memory copy has been trimmed, so that serving
+ * the same recent headers to several peers doesn't hit the database each time.
+ */
+class CSolutionCache
+{
+private:
+    typedef std::list<std::pair<uint256, std::vector<unsigned char> > > list_type;
+    list_type listSolutions;
+    boost::unordered_map<uint256, list_type::iterator, BlockHasher> mapSolutions;
+    size_t nMaxSize;
+    CCriticalSection cs_solutions;
+
+public:
+    CSolutionCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    bool Get(const uint256& hash, std::vector<unsigned char>& solution)
+    {
+        LOCK(cs_solutions);
+        auto it = mapSolutions.find(hash);
+        if (it == mapSolutions.end())
+            return false;
+        listSolutions.splice(listSolutions.begin(), listSolutions, it->second);
+        solution = it->second->second;
+        return true;
+    }
+
+    void Insert(const uint256& hash, const std::vector<unsigned char>& solution)
+    {
+        LOCK(cs_solutions);
+        if (mapSolutions.count(hash))
+            return;
+        listSolutions.push_front(std::make_pair(hash, solution));
+        mapSolutions[hash] = listSolutions.begin();
+        if (listSolutions.size() > nMaxSize) {
+            mapSolutions.erase(listSolutions.back().first);
+            listSolutions.pop_back();
+        }
+    }
+};
+
+CSolutionCache solutionCache(SOLUTION_CACHE_SIZE);
+
+/**
+ * The "block" messages last served to peers, complete with their message
+ * header, so that peers fetching the same (usually new tip) block share one
+ * buffer. Protected by cs_main.
+ */
+class CBlockMessageCache
+{
+private:
+    typedef std::list<std::pair<uint256, std::shared_ptr<const CSerializeData> > > list_type;
+    list_type listMessages;
+    boost::unordered_map<uint256, list_type::iterator, BlockHasher> mapMessages;
+    size_t nMaxSize;
+
+public:
+    CBlockMessageCache(size_t nMaxSizeIn) : nMaxSize(nMaxSizeIn) {}
+
+    std::shared_ptr<const CSerializeData> Get(const uint256& hash)
+    {
+        auto it = mapMessages.find(hash);
+        if (it == mapMessages.end())
+            return nullptr;
+        listMessages.splice(listMessages.begin(), listMessages, it->second);
+        return it->second->second;
+    }
+
+    void Insert(const uint256& hash, const std::shared_ptr<const CSerializeData>& msg)
+    {
+        if (mapMessages.count(hash))
+            return;
+        listMessages.push_front(std::make_pair(hash, msg));
+        mapMessages[hash] = listMessages.begin();
+        if (listMessages.size() > nMaxSize) {
+            mapMessages.erase(listMessages.back().first);
+            listMessages.pop_back();
+        }
+    }
+};
+
+CBlockMessageCache blockMessageCache(BLOCK_MESSAGE_CACHE_SIZE);
+
+}
+
+std::vector<unsigned char> CBlockIndex::GetSolution() const
+{
+    if (HasSolution())
+        return nSolution;
+
+    std::vector<unsigned char> solution;
+    if (solutionCache.Get(GetBlockHash(), solution))
+        return solution;
+
+    CDiskBlockIndex dbindex;
+    if (!pblocktree->ReadDiskBlockIndex(GetBlockHash(), dbindex)) {
+        LogPrintf("%s: ReadDiskBlockIndex failed to read index entry of block %s\n", __func__, GetBlockHash().ToString());
+        throw std::runtime_error("Failed to read index entry");
+    }
+    solutionCache.Insert(GetBlockHash(), dbindex.GetSolution());
+    return dbindex.GetSolution();
+}
+
+CBlockHeader CBlockIndex::GetBlockHeader() const
+{
+    CBlockHeader block;
+    block.nVersion       = nVersion;
+    if (pprev)
+        block.hashPrevBlock = pprev->GetBlockHash();
+    block.hashMerkleRoot = hashMerkleRoot;
+    block.hashFinalSaplingRoot   = hashFinalSaplingRoot;
+    block.nTime          = nTime;
+    block.nBits          = nBits;
+    block.nNonce         = nNonce;
+    block.nSolution      = GetSolution();
+    return block;
+}
+
+/** Recently read block and undo files, kept mapped (-maxmappedblockfiles). */
+static CMappedFileCache mappedBlockFiles;
+
+/**
+ * Find the record written at pos in a mapped block or undo file, and the
+ * nTrailing bytes that follow it. Records are preceded by their size.
+ * Returns null if the file cannot be mapped, so that the caller reads it
+ * the usual way.
+ */
+static std::shared_ptr<const CMappedFile> MapDiskRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailing,
+                                                       const char*& pbegin, const char*& pend)
+{
+    if (pos.IsNull() || pos.nPos < sizeof(uint32_t))
+        return nullptr;
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    std::shared_ptr<const CMappedFile> file = mappedBlockFiles.Get(path, pos.nPos);
+    if (!file)
+        return nullptr;
+    uint32_t nSize = ReadLE32((const unsigned char*)file->data() + pos.nPos - sizeof(uint32_t));
+    uint64_t nEnd = (uint64_t)pos.nPos + nSize + nTrailing;
+    if (file->size() < nEnd) {
+        // Written after the file was mapped
+        file = mappedBlockFiles.Get(path, nEnd);
+        if (!file)
+            return nullptr;
+    }
+    pbegin = file->data() + pos.nPos;
+    pend = file->data() + nEnd;
+    return file;
+}
+
+void SetMaxMappedBlockFiles(size_t nMaxFiles)
+{
+    mappedBlockFiles.SetMaxFiles(nMaxFiles);
+}
+
+/**
+ * Build the "block" message for pindex from the block as it is stored on
+ * disk, which is serialized the same way as on the network, instead of
+ * deserializing the block and serializing it again. Only the header is
+ * decoded, to check the block against the index.
+ */
+static std::shared_ptr<const CSerializeData> ReadBlockMessageFromDisk(const CBlockIndex* pindex)
+{
+    const CDiskBlockPos pos = pindex->GetBlockPos();
+    std::shared_ptr<CSerializeData> msg = std::make_shared<CSerializeData>();
+
+    const char* pbegin;
+    const char* pend;
+    std::shared_ptr<const CMappedFile> mapped = MapDiskRecord(pos, "blk", 0, pbegin, pend);
+    if (mapped) {
+        if ((size_t)(pend - pbegin) > MAX_BLOCK_SIZE) {
+            LogPrintf("%s: Invalid block size at %s\n", __func__, pos.ToString());
+            return nullptr;
+        }
+        msg->resize(CMessageHeader::HEADER_SIZE + (pend - pbegin));
+        memcpy(&(*msg)[CMessageHeader::HEADER_SIZE], pbegin, pend - pbegin);
+    } else {
+        if (pos.IsNull() || pos.nPos < sizeof(uint32_t))
+            return nullptr;
+        // Open history file at the size preceding the block
+        CAutoFile filein(OpenBlockFile(CDiskBlockPos(pos.nFile, pos.nPos - sizeof(uint32_t)), true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull()) {
+            LogPrintf("%s: OpenBlockFile failed for %s\n", __func__, pos.ToString());
+            return nullptr;
+        }
+        try {
+            uint32_t nSize;
+            filein >> nSize;
+            if (nSize > MAX_BLOCK_SIZE) {
+                LogPrintf("%s: Invalid block size at %s\n", __func__, pos.ToString());
+                return nullptr;
+            }
+            msg->resize(CMessageHeader::HEADER_SIZE + nSize);
+            filein.read(&(*msg)[CMessageHeader::HEADER_SIZE], nSize);
+        }
+        catch (const std::exception& e) {
+            LogPrintf("%s: I/O error - %s at %s\n", __func__, e.what(), pos.ToString());
+            return nullptr;
+        }
+    }
+
+    const char* pchPayload = &(*msg)[CMessageHeader::HEADER_SIZE];
+    const unsigned int nSize = msg->size() - CMessageHeader::HEADER_SIZE;
+    try {
+        CMemoryReader reader(pchPayload, pchPayload + nSize, SER_NETWORK, PROTOCOL_VERSION);
+        CBlockHeader header;
+        reader >> header;
+        if (header.GetHash() != pindex->GetBlockHash()) {
+            LogPrintf("%s: GetHash() doesn't match index for %s at %s\n", __func__, pindex->ToString(), pos.ToString());
+            return nullptr;
+        }
+    }
+    catch (const std::exception& e) {
+        LogPrintf("%s: Deserialize error - %s at %s\n", __func__, e.what(), pos.ToString());
+        return nullptr;
+    }
+
+    CMessageHeader hdr(Params().MessageStart(), "block", nSize);
+    uint256 hash = Hash(pchPayload, pchPayload + nSize);
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    assert(ssHeader.size() == CMessageHeader::HEADER_SIZE);
+    memcpy(&(*msg)[0], &ssHeader[0], CMessageHeader::HEADER_SIZE);
+    return msg;
+}
+
+/** Read a block from disk without checking its header. */
+static bool ReadBlockFromDiskUnchecked(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
+    const char* pbegin;
+    const char* pend;
+    std::shared_ptr<const CMappedFile> mapped = MapDiskRecord(pos, "blk", 0, pbegin, pend);
+    if (mapped) {
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s at %s", __func__, e.what(), pos.ToString());
+        }
+        return true;
+    }
+
     // Open history file to read
     CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
     if (filein.IsNull())
@@ -2360,6 +2808,14 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
 
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams)
+{
+    if (!ReadBlockFromDiskUnchecked(block, pos))
+        return false;
+
     // Check the header
     if (!(CheckEquihashSolution(&block, consensusParams) &&
           CheckProofOfWork(block.GetHash(), block.nBits, consensusParams)))
@@ -2368,16 +2824,27 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock, bool fTrustedHeader, const Consensus::Params& consensusParams)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos(), consensusParams))
+    if (!(fTrustedHeader ? ReadBlockFromDiskUnchecked(block, pos)
+                         : ReadBlockFromDisk(block, pos, consensusParams)))
         return false;
-    if (block.GetHash() != pindex->GetBlockHash())
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*): GetHash() doesn't match index for %s at %s",
-                pindex->ToString(), pindex->GetBlockPos().ToString());
+    if (block.GetHash() != hashBlock)
+        return error("%s: GetHash() doesn't match index for %s at %s", __func__,
+                hashBlock.ToString(), pos.ToString());
     return true;
 }
 
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    // The proof of work of every header in the block index was verified before
+    // it was added (or when it was loaded from the block tree database), and
+    // the block hash commits to the Equihash solution. Matching the hash of the
+    // block read against the index is therefore enough; only headers that were
+    // never validated go through the full Equihash and PoW checks again.
+    return ReadBlockFromDisk(block, pindex->GetBlockPos(), pindex->GetBlockHash(), pindex->IsValid(BLOCK_VALID_TREE), consensusParams);
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 150 * COIN;
@@ -2650,20 +3117,10 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.emplace_back();
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -2671,7 +3128,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -2716,14 +3173,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2741,8 +3198,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2802,11 +3259,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2818,7 +3275,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2870,19 +3327,33 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("%s: OpenBlockFile failed", __func__);
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> blockundo;
-        filein >> hashChecksum;
-    }
-    catch (const std::exception& e) {
-        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    const char* pbegin;
+    const char* pend;
+    std::shared_ptr<const CMappedFile> mapped = MapDiskRecord(pos, "rev", sizeof(hashChecksum), pbegin, pend);
+    if (mapped) {
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> blockundo;
+            reader >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize error - %s", __func__, e.what());
+        }
+    } else {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("%s: OpenBlockFile failed", __func__);
+
+        // Read block
+        try {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
+        catch (const std::exception& e) {
+            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -2897,45 +3368,44 @@ bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uin
 
 } // anon namespace
 
+enum DisconnectResult
+{
+    DISCONNECT_OK,      // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED   // Something else went wrong.
+};
+
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
- * @return True on success.
+ * @return DISCONNECT_OK, or DISCONNECT_UNCLEAN/DISCONNECT_FAILED on inconsistent undo data.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static DisconnectResult ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
 
-    return fClean;
-}
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (!alternate.IsSpent()) {
+            undo.nHeight = alternate.nHeight;
+            undo.fCoinBase = alternate.fCoinBase;
+        } else {
+            error("%s: undo data adding output to missing transaction", __func__);
+            return DISCONNECT_FAILED;
+        }
+    }
+    view.AddCoin(out, std::move(undo), !fClean);
 
-enum DisconnectResult
-{
-    DISCONNECT_OK,      // All good.
-    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
-    DISCONNECT_FAILED   // Something else went wrong.
-};
+    return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
+}
 
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
@@ -3028,21 +3498,16 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        bool is_coinbase = tx.IsCoinBase();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || (uint32_t)pindex->nHeight != coin.nHeight || is_coinbase != coin.fCoinBase) {
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+                }
+            }
         }
 
         // unspend nullifiers
@@ -3050,22 +3515,24 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size()) {
                 error("DisconnectBlock(): transaction and undo data inconsistent");
                 return DISCONNECT_FAILED;
             }
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
-                    fClean = false;
+                DisconnectResult res = ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out);
+                if (res == DISCONNECT_FAILED)
+                    return DISCONNECT_FAILED;
+                fClean = fClean && res != DISCONNECT_UNCLEAN;
 
                 // insightexplorer
                 // https://github.com/bitpay/bitcoin/commit/017f548ea6d89423ef568117447e61dd5707ec42#diff-7ec3c68a81efff79b6ca22ac1f1eabbaR2304
                 const CTxIn input = tx.vin[j];
                 if (fAddressIndex && updateIndices) {
-                    const CTxOut &prevout = view.GetOutputFor(input);
+                    const Coin &undo = view.AccessCoin(input.prevout);
+                    const CTxOut &prevout = undo.out;
                     CScript::ScriptType scriptType = prevout.scriptPubKey.GetType();
                     if (scriptType != CScript::UNKNOWN) {
                         uint160 const addrHash = prevout.scriptPubKey.AddressHash();
@@ -3136,6 +3603,12 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    if (fFinalize) {
+        // Mappings must not outlive the data they cover
+        mappedBlockFiles.Erase(GetBlockPosFilename(posOld, "blk"));
+        mappedBlockFiles.Erase(GetBlockPosFilename(posOld, "rev"));
+    }
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -3156,23 +3629,73 @@ void static FlushBlockFile(bool fFinalize = false)
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
 static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+static CCheckQueue<CSaplingCheck> saplingcheckqueue(8);
 
 void ThreadScriptCheck() {
     RenameThread("zelcash-scriptch");
     scriptcheckqueue.Thread();
 }
 
-//
-// Called periodically asynchronously; alerts if it smells like
-// we're being fed a bad chain (blocks being generated much
-// too slowly or too quickly).
-//
-void PartitionCheck(bool (*initialDownloadCheck)(const CChainParams&),
-                    CCriticalSection& cs, const CBlockIndex *const &bestHeader,
-                    int64_t nPowTargetSpacing)
-{
-    strMiscWarning = "";
-    if (bestHeader == NULL || initialDownloadCheck(Params())) return;
+void ThreadSaplingCheck() {
+    RenameThread("zelcash-saplingch");
+    saplingcheckqueue.Thread();
+}
+
+/**
+ * Closure representing the Equihash solution and proof of work checks of a
+ * received block header. The result is stored in *pfValid rather than
+ * returned, so that one bad header doesn't stop the checks of the others.
+ */
+class CHeaderCheck
+{
+private:
+    const CBlockHeader *pheader;
+    const Consensus::Params *pparams;
+    char *pfValid;
+
+public:
+    CHeaderCheck(): pheader(0), pparams(0), pfValid(0) {}
+    CHeaderCheck(const CBlockHeader& headerIn, const Consensus::Params& paramsIn, char* pfValidIn) :
+        pheader(&headerIn), pparams(&paramsIn), pfValid(pfValidIn) { }
+
+    bool operator()() {
+        *pfValid = CheckEquihashSolution(pheader, *pparams) &&
+                   CheckProofOfWork(pheader->GetHash(), pheader->nBits, *pparams);
+        return true;
+    }
+
+    void swap(CHeaderCheck &check) {
+        std::swap(pheader, check.pheader);
+        std::swap(pparams, check.pparams);
+        std::swap(pfValid, check.pfValid);
+    }
+};
+
+static CCheckQueue<CHeaderCheck> headercheckqueue(8);
+
+void ThreadHeaderCheck() {
+    RenameThread("zelcash-headerch");
+    headercheckqueue.Thread();
+}
+
+static CCoinsPrefetcher coinsprefetcher;
+
+void ThreadPrefetchCoins() {
+    RenameThread("zelcash-prefetch");
+    coinsprefetcher.Thread(Params().GetConsensus());
+}
+
+//
+// Called periodically asynchronously; alerts if it smells like
+// we're being fed a bad chain (blocks being generated much
+// too slowly or too quickly).
+//
+void PartitionCheck(bool (*initialDownloadCheck)(const CChainParams&),
+                    CCriticalSection& cs, const CBlockIndex *const &bestHeader,
+                    int64_t nPowTargetSpacing)
+{
+    strMiscWarning = "";
+    if (bestHeader == NULL || initialDownloadCheck(Params())) return;
 
     const int SPAN_HOURS=4;
     const int SPAN_SECONDS=SPAN_HOURS*60*60;
@@ -3254,9 +3777,15 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     if (!CheckBlock(block, state, chainparams, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
-    if (!ContextualCheckBlock(block,state, chainparams,pindex->pprev, false))
+    // Collect the Sapling proof checks of the whole block and start verifying
+    // them on the worker threads while the rest of the block is connected.
+    std::vector<CSaplingCheck> vSaplingChecks;
+    if (!ContextualCheckBlock(block,state, chainparams,pindex->pprev, false, nScriptCheckThreads ? &vSaplingChecks : NULL))
         return false;
 
+    CCheckQueueControl<CSaplingCheck> saplingControl(nScriptCheckThreads ? &saplingcheckqueue : NULL);
+    saplingControl.Add(vSaplingChecks);
+
     // verify that the view's current state corresponds to the previous block
     uint256 hashPrevBlock = pindex->pprev == NULL ? uint256() : pindex->pprev->GetBlockHash();
     assert(hashPrevBlock == view.GetBestBlock());
@@ -3307,10 +3836,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o))) {
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+            }
+        }
     }
 
     // Check the deterministric zelnode payouts
@@ -3323,9 +3854,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-
-    // DERSIG (BIP66) is also always enforced, but does not have a flag.
+    unsigned int flags = BLOCK_SCRIPT_VERIFY_FLAGS;
 
     CBlockUndo blockundo;
     CZelnodeTxBlockUndo zelnodeTxBlockUndo;
@@ -3370,6 +3899,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Grab the consensus branch ID for the block's height
     auto consensusBranchId = CurrentEpochBranchId(pindex->nHeight, chainparams.GetConsensus());
 
+    // Entries of the validated transaction cache used by this block
+    std::vector<uint256> vValidatedEntries;
+
     std::vector<PrecomputedTransactionData> txdata;
     txdata.reserve(block.vtx.size()); // Required so that pointers to individual PrecomputedTransactionData don't get invalidated
 
@@ -3486,9 +4018,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
 
+            // Skip the script checks of transactions already fully verified at mempool acceptance
+            bool fScriptChecks = fExpensiveChecks;
+            uint256 validatedEntry = txValidationCache.ComputeEntry(hash, flags, consensusBranchId);
+            if (fScriptChecks && txValidationCache.Get(validatedEntry)) {
+                fScriptChecks = false;
+                vValidatedEntries.push_back(validatedEntry);
+            }
+
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!ContextualCheckInputs(tx, state, view, fExpensiveChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
+            if (!ContextualCheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, txdata[i], chainparams.GetConsensus(), consensusBranchId, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -3583,12 +4123,21 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (!control.Wait())
         return state.DoS(100, false);
+    if (!saplingControl.Wait())
+        return state.DoS(100, error("ConnectBlock(): Sapling proof or signature invalid"),
+                         REJECT_INVALID, "bad-txns-sapling-proof-invalid");
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
     if (fJustCheck)
         return true;
 
+    // The transactions are now in the chain and will not be connected again
+    // unless they return to the mempool, which re-validates them.
+    for (const uint256& entry : vValidatedEntries) {
+        txValidationCache.Erase(entry);
+    }
+
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || !pindex->IsValid(BLOCK_VALID_SCRIPTS))
     {
@@ -3730,10 +4279,15 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         nLastSetChain = nNow;
     }
     size_t cacheSize = pcoinsTip->DynamicMemoryUsage();
+    // When the coin database writes in the background, the changes it has taken
+    // over are held in memory until they are written, so the cache only gets
+    // half of the budget.
+    bool fAsyncFlush = pcoinsdbview && pcoinsdbview->IsAsyncFlush();
+    size_t nCacheLimit = fAsyncFlush ? nCoinCacheUsage / 2 : nCoinCacheUsage;
     // The cache is large and close to the limit, but we have time now (not in the middle of a block processing).
-    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCoinCacheUsage;
+    bool fCacheLarge = mode == FLUSH_STATE_PERIODIC && cacheSize * (10.0/9) > nCacheLimit;
     // The cache is over the limit, we have to write now.
-    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCoinCacheUsage;
+    bool fCacheCritical = mode == FLUSH_STATE_IF_NEEDED && cacheSize > nCacheLimit;
     // It's been a while since we wrote the block index to disk. Do this frequently, so we don't need to redownload after a crash.
     bool fPeriodicWrite = mode == FLUSH_STATE_PERIODIC && nNow > nLastWrite + (int64_t)DATABASE_WRITE_INTERVAL * 1000000;
     // It's been very long since we flushed the cache. Do this infrequently, to optimize cache usage.
@@ -3757,32 +4311,46 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 setDirtyFileInfo.erase(it++);
             }
             std::vector<const CBlockIndex*> vBlocks;
+            std::vector<CBlockIndex*> vWritten;
             vBlocks.reserve(setDirtyBlockIndex.size());
+            vWritten.reserve(setDirtyBlockIndex.size());
             for (set<CBlockIndex*>::iterator it = setDirtyBlockIndex.begin(); it != setDirtyBlockIndex.end(); ) {
                 vBlocks.push_back(*it);
+                vWritten.push_back(*it);
                 setDirtyBlockIndex.erase(it++);
             }
             if (!pblocktree->WriteBatchSync(vFiles, nLastBlockFile, vBlocks)) {
                 return AbortNode(state, "Files to write to block index database");
             }
+            // The solutions of the entries just written can now be read back
+            // from the block tree database when needed.
+            for (CBlockIndex* pindex : vWritten) {
+                pindex->TrimSolution();
+            }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
-            UnlinkPrunedFiles(setFilesToPrune);
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // Wait for the background writer when the caller needs the state on
+        // disk, and before block files that a replay could need are removed.
+        if (pcoinsdbview && (!fAsyncFlush || mode == FLUSH_STATE_ALWAYS || fFlushForPrune)) {
+            if (!pcoinsdbview->Sync())
+                return AbortNode(state, "Failed to write to coin database");
+        }
+        // Finally remove any pruned files
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
 
         // Dump Zelnode cache to database
         g_zelnodeCache.DumpZelnodeCache();
@@ -3949,6 +4517,9 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     SaplingMerkleTree oldSaplingTree;
     assert(pcoinsTip->GetSproutAnchorAt(pcoinsTip->GetBestAnchor(SPROUT), oldSproutTree));
     assert(pcoinsTip->GetSaplingAnchorAt(pcoinsTip->GetBestAnchor(SAPLING), oldSaplingTree));
+    // Add the inputs that were read ahead of time.
+    if (nPrefetchThreads)
+        coinsprefetcher.Apply(pindexNew, *pcoinsTip);
     // Apply the block atomically to the chain state.
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
@@ -4145,6 +4716,16 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
         // Connect new blocks.
         BOOST_REVERSE_FOREACH(CBlockIndex *pindexConnect, vpindexToConnect) {
+            // Have the inputs of the next blocks read while this one connects.
+            if (nPrefetchThreads) {
+                int nPrefetchHeight = std::min(pindexConnect->nHeight + PREFETCH_BLOCKS_AHEAD, pindexMostWork->nHeight);
+                for (int nNext = pindexConnect->nHeight + 1; nNext <= nPrefetchHeight; nNext++) {
+                    CBlockIndex* pindexNext = pindexMostWork->GetAncestor(nNext);
+                    if (!(pindexNext->nStatus & BLOCK_HAVE_DATA))
+                        break;
+                    coinsprefetcher.Schedule(pindexNext);
+                }
+            }
             if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : NULL)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
@@ -4197,9 +4778,11 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
     do {
         boost::this_thread::interruption_point();
 
+        const CBlockIndex *pindexFork;
         bool fInitialDownload;
         {
             LOCK(cs_main);
+            CBlockIndex *pindexOldTip = chainActive.Tip();
             pindexMostWork = FindMostWorkChain();
 
             // Whether we have anything to do at all.
@@ -4210,6 +4793,7 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = chainActive.FindFork(pindexOldTip);
             fInitialDownload = IsInitialBlockDownload(chainparams);
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -4217,15 +4801,31 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Find the hashes of all blocks that weren't previously in the best chain.
+            std::vector<uint256> vHashes;
+            CBlockIndex *pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainparams.Checkpoints());
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes) {
+                            pnode->PushBlockHash(hash);
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -4675,10 +5275,15 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
         }
     }
 
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, block.vtx)
-        if (!CheckTransaction(tx, state, verifier))
+    // Check transactions. The JoinSplit proofs of transactions already fully
+    // verified at mempool acceptance don't need to be verified again.
+    auto disabledVerifier = libzelcash::ProofVerifier::Disabled();
+    auto consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        libzelcash::ProofVerifier& txVerifier = IsTxValidated(tx, consensusBranchId) ? disabledVerifier : verifier;
+        if (!CheckTransaction(tx, state, txVerifier))
             return error("CheckBlock(): CheckTransaction failed: %s", tx.GetHash().GetHex());
+    }
 
     unsigned int nSigOps = 0;
     BOOST_FOREACH(const CTransaction& tx, block.vtx)
@@ -4769,16 +5374,24 @@ bool ContextualCheckBlockHeader(
 
 bool ContextualCheckBlock(
     const CBlock& block, CValidationState& state,
-    const CChainParams& chainparams, CBlockIndex * const pindexPrev, bool fFromAccept)
+    const CChainParams& chainparams, CBlockIndex * const pindexPrev, bool fFromAccept,
+    std::vector<CSaplingCheck> *pvSaplingChecks)
 {
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
     const Consensus::Params& consensusParams = chainparams.GetConsensus();
 
+    auto consensusBranchId = CurrentEpochBranchId(nHeight, consensusParams);
+
     // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
 
+        // The Sapling proofs of transactions already fully verified at mempool
+        // acceptance are collected into a scratch vector and dropped.
+        std::vector<CSaplingCheck> vSkippedSaplingChecks;
+        std::vector<CSaplingCheck> *pvTxSaplingChecks = IsTxValidated(tx, consensusBranchId) ? &vSkippedSaplingChecks : pvSaplingChecks;
+
         // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(tx, state, chainparams, nHeight,100, fFromAccept)) {
+        if (!ContextualCheckTransaction(tx, state, chainparams, nHeight,100, fFromAccept, false, IsInitialBlockDownload, pvTxSaplingChecks)) {
             return error("%s: Failed Check tx : %s, on block : %s",__func__, tx.GetHash().GetHex(), block.GetHash().GetHex()); // Failure reason has been set in validation state object
         }
 
@@ -4808,7 +5421,7 @@ bool ContextualCheckBlock(
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL)
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex=NULL, bool fCheckPOW=true)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -4825,7 +5438,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
         return true;
     }
 
-    if (!CheckBlockHeader(block, state, chainparams))
+    if (!CheckBlockHeader(block, state, chainparams, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -4944,7 +5557,7 @@ bool ProcessNewBlock(CValidationState& state, const CChainParams& chainparams, c
 
     {
         LOCK(cs_main);
-        bool fRequested = MarkBlockAsReceived(pblock->GetHash());
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash(), pfrom ? pfrom->GetId() : -1);
         fRequested |= fForceProcessing;
         if (!checked) {
             if (state.GetRejectReason() == "bad-cb-payee") {
@@ -5049,6 +5662,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        mappedBlockFiles.Erase(GetBlockPosFilename(pos, "blk"));
+        mappedBlockFiles.Erase(GetBlockPosFilename(pos, "rev"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -5170,6 +5785,123 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Apply the effects of a block on the utxo cache, ignoring that it may already have been applied. */
+static bool RollforwardBlock(const CBlockIndex* pindex, CCoinsViewCache& inputs, const CChainParams& params)
+{
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, params.GetConsensus())) {
+        return error("ReplayBlock(): ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+    }
+
+    SproutMerkleTree sprout_tree;
+    SaplingMerkleTree sapling_tree;
+    if (!inputs.GetSproutAnchorAt(inputs.GetBestAnchor(SPROUT), sprout_tree) ||
+        !inputs.GetSaplingAnchorAt(inputs.GetBestAnchor(SAPLING), sapling_tree)) {
+        return error("ReplayBlock(): note commitment trees not found at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+    }
+
+    for (const CTransaction& tx : block.vtx) {
+        if (!tx.IsCoinBase()) {
+            for (const CTxIn &txin : tx.vin) {
+                inputs.SpendCoin(txin.prevout);
+            }
+        }
+        inputs.SetNullifiers(tx, true);
+        // Pass check = true as every addition may be an overwrite.
+        AddCoins(inputs, tx, pindex->nHeight, true);
+
+        for (const JSDescription &joinsplit : tx.vJoinSplit) {
+            for (const uint256 &note_commitment : joinsplit.commitments) {
+                sprout_tree.append(note_commitment);
+            }
+        }
+        for (const OutputDescription &outputDescription : tx.vShieldedOutput) {
+            sapling_tree.append(outputDescription.cm);
+        }
+    }
+
+    inputs.PushAnchor(sprout_tree);
+    inputs.PushAnchor(sapling_tree);
+    return true;
+}
+
+/**
+ * Complete a chainstate flush that was interrupted while it was being written
+ * in several batches. The database then holds a mix of the states at the old
+ * and the new best block, which is resolved by disconnecting the old blocks
+ * down to the fork point and applying the blocks up to the new one again.
+ * Only the coin database is replayed; the zelnode database is written after it.
+ */
+static bool ReplayBlocks(const CChainParams& params)
+{
+    LOCK(cs_main);
+
+    CCoinsViewCache cache(pcoinsTip);
+    ZelnodeCache zelnodeCache;
+
+    std::vector<uint256> hashHeads = cache.GetHeadBlocks();
+    if (hashHeads.empty()) return true; // We're already in a consistent state.
+    if (hashHeads.size() != 2) return error("ReplayBlocks(): unknown inconsistent state");
+
+    uiInterface.InitMessage(_("Replaying blocks..."));
+    LogPrintf("Replaying blocks\n");
+
+    CBlockIndex* pindexOld = NULL;  // Old tip during the interrupted flush.
+    CBlockIndex* pindexNew;         // New tip during the interrupted flush.
+    CBlockIndex* pindexFork = NULL; // Latest block common to both the old and the new tip.
+
+    if (mapBlockIndex.count(hashHeads[0]) == 0) {
+        return error("ReplayBlocks(): reorganization to unknown block requested");
+    }
+    pindexNew = mapBlockIndex[hashHeads[0]];
+
+    if (!hashHeads[1].IsNull()) { // The old tip is allowed to be 0, indicating it's the first flush.
+        if (mapBlockIndex.count(hashHeads[1]) == 0) {
+            return error("ReplayBlocks(): reorganization from unknown block requested");
+        }
+        pindexOld = mapBlockIndex[hashHeads[1]];
+        pindexFork = LastCommonAncestor(pindexOld, pindexNew);
+        assert(pindexFork != NULL);
+    }
+
+    // Rollback along the old branch.
+    while (pindexOld != pindexFork) {
+        if (pindexOld->nHeight > 0) { // Never disconnect the genesis block.
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexOld, params.GetConsensus())) {
+                return error("RollbackBlock(): ReadBlockFromDisk() failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+            LogPrintf("Rolling back %s (%i)\n", pindexOld->GetBlockHash().ToString(), pindexOld->nHeight);
+            CValidationState state;
+            cache.SetBestBlock(pindexOld->GetBlockHash());
+            DisconnectResult res = DisconnectBlock(block, state, pindexOld, cache, &zelnodeCache, params, false);
+            if (res == DISCONNECT_FAILED) {
+                return error("RollbackBlock(): DisconnectBlock failed at %d, hash=%s", pindexOld->nHeight, pindexOld->GetBlockHash().ToString());
+            }
+            // If DISCONNECT_UNCLEAN is returned, it means a non-existing UTXO was deleted, or an existing UTXO was
+            // overwritten. It corresponds to cases where the block-to-be-disconnect never had all its operations
+            // applied to the UTXO set. However, as both writing a UTXO and deleting a UTXO are idempotent operations,
+            // the result is still a version of the UTXO set with the effects of that block undone.
+        }
+        pindexOld = pindexOld->pprev;
+    }
+
+    // Roll forward from the forking point to the new tip.
+    int nForkHeight = pindexFork ? pindexFork->nHeight : 0;
+    for (int nHeight = nForkHeight + 1; nHeight <= pindexNew->nHeight; ++nHeight) {
+        CBlockIndex* pindex = pindexNew->GetAncestor(nHeight);
+        LogPrintf("Rolling forward %s (%i)\n", pindex->GetBlockHash().ToString(), nHeight);
+        if (!RollforwardBlock(pindex, cache, params)) return false;
+    }
+
+    cache.SetBestBlock(pindexNew->GetBlockHash());
+    if (!cache.Flush() || !pcoinsTip->Flush() || (pcoinsdbview && !pcoinsdbview->Sync())) {
+        return error("ReplayBlocks(): failed to write the coin database");
+    }
+    uiInterface.InitMessage(_("Loading block index..."));
+    return true;
+}
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
@@ -5324,6 +6056,10 @@ bool static LoadBlockIndexDB()
         }
     }
 
+    // Complete a chainstate flush that was interrupted by a crash
+    if (!ReplayBlocks(chainparams))
+        return false;
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -5783,6 +6519,148 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
     return nLoaded > 0;
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+static std::atomic<bool> fMempoolLoaded(false);
+
+bool IsMempoolLoaded()
+{
+    return fMempoolLoaded;
+}
+
+void SetMempoolLoaded()
+{
+    fMempoolLoaded = true;
+}
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nAccepted = 0;
+    int64_t nFailed = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %u, not loading it\n", nVersion);
+            return false;
+        }
+
+        // The deltas are set first, so that the fee checks of the
+        // transactions they apply to take them into account.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        filein >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); it++)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+        uint64_t nCount;
+        filein >> nCount;
+        // Transactions were saved in the order they entered the mempool, so
+        // nearly all follow the unconfirmed transactions they spend. The few
+        // that came in the same second as a parent and were put before it are
+        // retried once the others are in.
+        std::vector<std::pair<CTransaction, int64_t> > vMissingInputs;
+        for (uint64_t i = 0; i < nCount; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx;
+            filein >> nTime;
+
+            CValidationState state;
+            bool fMissingInputs;
+            {
+                LOCK(cs_main);
+                if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, &fMissingInputs, nTime))
+                    nAccepted++;
+                else if (fMissingInputs)
+                    vMissingInputs.push_back(std::make_pair(tx, nTime));
+                else
+                    nFailed++;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+        size_t nMissingBefore;
+        do {
+            nMissingBefore = vMissingInputs.size();
+            std::vector<std::pair<CTransaction, int64_t> > vRetry;
+            vRetry.swap(vMissingInputs);
+            LOCK(cs_main);
+            for (size_t i = 0; i < vRetry.size(); i++) {
+                CValidationState state;
+                bool fMissingInputs;
+                if (AcceptToMemoryPoolWithTime(mempool, state, vRetry[i].first, true, &fMissingInputs, vRetry[i].second))
+                    nAccepted++;
+                else if (fMissingInputs)
+                    vMissingInputs.push_back(vRetry[i]);
+                else
+                    nFailed++;
+            }
+        } while (!vMissingInputs.empty() && vMissingInputs.size() < nMissingBefore);
+        nFailed += vMissingInputs.size();
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, in %dms\n", nAccepted, nFailed, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::vector<std::pair<int64_t, CTransaction> > vEntries;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::indexed_transaction_set::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); it++)
+            vEntries.push_back(std::make_pair(it->GetTime(), it->GetTx()));
+    }
+    // Entry times order the transactions after their unconfirmed parents,
+    // except among ones that entered in the same second.
+    std::sort(vEntries.begin(), vEntries.end(), [](const std::pair<int64_t, CTransaction>& a, const std::pair<int64_t, CTransaction>& b) {
+        return a.first < b.first;
+    });
+
+    int64_t nMid = GetTimeMillis();
+    try {
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        FILE* fileout = fopen(pathNew.string().c_str(), "wb");
+        if (!fileout) {
+            LogPrintf("%s: Failed to open %s\n", __func__, pathNew.string());
+            return false;
+        }
+        CAutoFile file(fileout, SER_DISK, CLIENT_VERSION);
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << (uint64_t)vEntries.size();
+        for (size_t i = 0; i < vEntries.size(); i++) {
+            file << vEntries[i].second;
+            file << vEntries[i].first;
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathNew, GetDataDir() / "mempool.dat");
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid - nStart) * 0.001, (GetTimeMillis() - nMid) * 0.001);
+    return true;
+}
+
 void static CheckBlockIndex(const Consensus::Params& consensusParams)
 {
     if (!fCheckBlockIndex) {
@@ -6060,7 +6938,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -6069,6 +6948,25 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
     return true;
 }
 
+/**
+ * The "cmpctblock" message for pindex, built from the block on disk unless it
+ * is the one last built. Requires cs_main.
+ */
+static std::shared_ptr<const CSerializeData> GetCompactBlockMessage(const CBlockIndex* pindex, const Consensus::Params& consensusParams)
+{
+    if (mostRecentCompactBlockMessage && hashMostRecentCompactBlock == pindex->GetBlockHash())
+        return mostRecentCompactBlockMessage;
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindex, consensusParams))
+        return nullptr;
+    std::shared_ptr<const CSerializeData> msg = CreateMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    if (pindex == chainActive.Tip()) {
+        hashMostRecentCompactBlock = pindex->GetBlockHash();
+        mostRecentCompactBlockMessage = msg;
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParams)
 {
     int currentHeight = GetHeight();
@@ -6089,7 +6987,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -6115,14 +7013,33 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Compact blocks are only worth it for blocks whose
+                    // transactions the peer may still have in its mempool.
+                    std::shared_ptr<const CSerializeData> cmpctblock;
+                    if (inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                        cmpctblock = GetCompactBlockMessage(mi->second, consensusParams);
+                    if (cmpctblock)
+                    {
+                        pfrom->PushRawMessage(cmpctblock);
+                    }
+                    else if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Send block from disk as stored, or as recently sent to another peer
+                        std::shared_ptr<const CSerializeData> msg = blockMessageCache.Get(inv.hash);
+                        if (!msg) {
+                            msg = ReadBlockMessageFromDisk((*mi).second);
+                            if (!msg)
+                                assert(!"cannot load block from disk");
+                            blockMessageCache.Insert(inv.hash, msg);
+                        }
+                        pfrom->PushRawMessage(msg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second, consensusParams))
+                            assert(!"cannot load block from disk");
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -6136,7 +7053,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -6173,9 +7090,9 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                     // Send stream from relay memory
                     {
                         LOCK(cs_mapRelay);
-                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                        map<CInv, std::shared_ptr<const CSerializeData> >::iterator mi = mapRelay.find(inv);
                         if (mi != mapRelay.end()) {
-                            pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                            pfrom->PushRawMessage((*mi).second);
                             pushed = true;
                         }
                     }
@@ -6217,6 +7134,410 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/**
+ * Process a block a peer sent us, in full or reconstructed from a compact
+ * block, and punish the peer if it is invalid. A peer whose block becomes our
+ * new tip is asked to announce the next ones with compact blocks.
+ */
+static void ProcessBlockFromPeer(CNode* pfrom, const std::string& strCommand, const CBlock& block, bool fForceProcessing, const CChainParams& chainparams)
+{
+    const uint256 hash = block.GetHash();
+    CValidationState state;
+    ProcessNewBlock(state, chainparams, pfrom, &block, fForceProcessing, NULL);
+    int nDoS;
+    if (state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+        if (nDoS > 0) {
+            LOCK(cs_main);
+            Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else if (!IsInitialBlockDownload(chainparams)) {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == hash)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(State(pfrom->GetId()), pfrom);
+    }
+}
+
+/**
+ * Process headers a peer sent us or announced a block with, and fetch the
+ * blocks they lead to if they have at least as much work as our tip.
+ */
+static bool ProcessHeaders(CNode* pfrom, const std::vector<CBlockHeader>& headers, const CChainParams& chainparams)
+{
+    const unsigned int nCount = headers.size();
+
+    // Verify the Equihash solutions and proof of work of the headers we
+    // don't know yet on the header check threads, before taking cs_main
+    // to insert them in order. Headers that fail here are checked again
+    // by AcceptBlockHeader, which reports the failure.
+    std::vector<char> vPowValid(nCount, 0);
+    {
+        std::vector<CHeaderCheck> vChecks;
+        {
+            LOCK(cs_main);
+            for (unsigned int n = 0; n < nCount; n++) {
+                if (!mapBlockIndex.count(headers[n].GetHash()))
+                    vChecks.push_back(CHeaderCheck(headers[n], chainparams.GetConsensus(), &vPowValid[n]));
+            }
+        }
+        if (nScriptCheckThreads) {
+            CCheckQueueControl<CHeaderCheck> control(&headercheckqueue);
+            control.Add(vChecks);
+            control.Wait();
+        } else {
+            BOOST_FOREACH(CHeaderCheck& check, vChecks)
+                check();
+        }
+    }
+
+    LOCK(cs_main);
+
+    if (nCount == 0) {
+        // Nothing interesting. Stop asking this peers for more headers.
+        return true;
+    }
+
+    CNodeState *nodestate = State(pfrom->GetId());
+
+    // A block announced with headers whose parent we don't have yet is
+    // normal when blocks are found in quick succession. Ask the peer for the
+    // headers in between instead of penalizing it, unless it keeps sending
+    // announcements that don't connect.
+    if (nCount <= MAX_BLOCKS_TO_ANNOUNCE && mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end()) {
+        nodestate->nUnconnectingHeaders++;
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+        LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                headers[0].GetHash().ToString(), headers[0].hashPrevBlock.ToString(),
+                pindexBestHeader->nHeight, pfrom->id, nodestate->nUnconnectingHeaders);
+        // The peer has the announced block, which lets it be downloaded from
+        // this peer once the headers connect, whoever sends them.
+        UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+        if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0)
+            Misbehaving(pfrom->GetId(), 20);
+        return true;
+    }
+
+    CBlockIndex *pindexLast = NULL;
+    for (unsigned int n = 0; n < nCount; n++) {
+        const CBlockHeader& header = headers[n];
+        CValidationState state;
+        if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("non-continuous headers sequence");
+        }
+        if (!AcceptBlockHeader(header, state, chainparams, &pindexLast, !vPowValid[n])) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received");
+            }
+        }
+    }
+
+    nodestate->nUnconnectingHeaders = 0;
+
+    if (pindexLast)
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+
+    if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        // Headers message had its maximum size; the peer may have more headers.
+        // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
+        // from there instead.
+        LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
+        pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
+    }
+
+    bool fCanDirectFetch = CanDirectFetch(chainparams.GetConsensus());
+    // If this set of headers is valid and ends in a block with at least as
+    // much work as our tip, download as much as possible.
+    if (fCanDirectFetch && pindexLast && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+        vector<CBlockIndex *> vToFetch;
+        CBlockIndex *pindexWalk = pindexLast;
+        // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+        while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                    !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                // We don't have this block, and it's not yet in flight.
+                vToFetch.push_back(pindexWalk);
+            }
+            pindexWalk = pindexWalk->pprev;
+        }
+        // If pindexWalk still isn't on our main chain, we're looking at a
+        // very large reorg at a time we think we're close to caught up to
+        // the main chain -- this shouldn't really happen.  Bail out on the
+        // direct fetch and rely on parallel download instead.
+        if (!chainActive.Contains(pindexWalk)) {
+            LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                    pindexLast->GetBlockHash().ToString(),
+                    pindexLast->nHeight);
+        } else {
+            vector<CInv> vGetData;
+            // Download as much as possible, from earliest to latest.
+            BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                    // Can't download any more from this peer
+                    break;
+                }
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                LogPrint("net", "Requesting block %s from  peer=%d\n",
+                        pindex->GetBlockHash().ToString(), pfrom->id);
+            }
+            if (vGetData.size() > 1) {
+                LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                        pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+            }
+            if (vGetData.size() > 0) {
+                if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1) {
+                    // A single new block will mostly consist of
+                    // transactions we already have.
+                    vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                }
+                pfrom->PushMessage("getdata", vGetData);
+            }
+        }
+    }
+
+    CheckBlockIndex(chainparams.GetConsensus());
+    return true;
+}
+
+void ProcessTransaction(CNode* pfrom, const CTransaction& tx, const CValidationState* pstatePrecheck, uint32_t consensusBranchId)
+{
+    vector<uint256> vWorkQueue;
+    vector<uint256> vEraseQueue;
+    CInv inv(MSG_TX, tx.GetHash());
+
+    LOCK(cs_main);
+
+    bool fMissingInputs = false;
+    CValidationState state;
+
+    // The next block may have moved to another consensus branch since, in
+    // which case everything is checked again.
+    bool fProofsChecked = false;
+    if (pstatePrecheck &&
+        CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus()) == consensusBranchId) {
+        if (pstatePrecheck->IsValid())
+            fProofsChecked = true;
+        else
+            state = *pstatePrecheck;
+    }
+
+    pfrom->setAskFor.erase(inv.hash);
+    mapAlreadyAskedFor.erase(inv);
+
+    if (!AlreadyHave(inv) && state.IsValid() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, fProofsChecked))
+    {
+        mempool.check(pcoinsTip);
+        RelayTransaction(tx);
+        vWorkQueue.push_back(inv.hash);
+
+        LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
+            pfrom->id, pfrom->cleanSubVer,
+            tx.GetHash().ToString(),
+            mempool.mapTx.size());
+
+        // Recursively process any orphan transactions that depended on this one
+        set<NodeId> setMisbehaving;
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
+            if (itByPrev == mapOrphanTransactionsByPrev.end())
+                continue;
+            for (set<uint256>::iterator mi = itByPrev->second.begin();
+                 mi != itByPrev->second.end();
+                 ++mi)
+            {
+                const uint256& orphanHash = *mi;
+                const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
+                NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
+                bool fMissingInputs2 = false;
+                // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                CValidationState stateDummy;
+
+
+                if (setMisbehaving.count(fromPeer))
+                    continue;
+                if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                    RelayTransaction(orphanTx);
+                    vWorkQueue.push_back(orphanHash);
+                    vEraseQueue.push_back(orphanHash);
+                }
+                else if (!fMissingInputs2)
+                {
+                    int nDos = 0;
+                    if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                    {
+                        // Punish peer that gave us an invalid orphan tx
+                        Misbehaving(fromPeer, nDos);
+                        setMisbehaving.insert(fromPeer);
+                        LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                    }
+                    // Has inputs but not accepted to mempool
+                    // Probably non-standard or insufficient fee/priority
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                    vEraseQueue.push_back(orphanHash);
+                    assert(recentRejects);
+                    recentRejects->insert(orphanHash);
+                }
+                mempool.check(pcoinsTip);
+            }
+        }
+
+        BOOST_FOREACH(uint256 hash, vEraseQueue)
+            EraseOrphanTx(hash);
+    }
+    // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
+    else if (fMissingInputs &&
+             tx.vJoinSplit.empty() &&
+             tx.vShieldedSpend.empty() &&
+             tx.vShieldedOutput.empty())
+    {
+        AddOrphanTx(tx, pfrom->GetId());
+
+        // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+        unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+        unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+        if (nEvicted > 0)
+            LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+    } else {
+        assert(recentRejects);
+        recentRejects->insert(tx.GetHash());
+
+        if (pfrom->fWhitelisted) {
+            // Always relay transactions received from whitelisted peers, even
+            // if they were already in the mempool or rejected from it due
+            // to policy, allowing the node to function as a gateway for
+            // nodes hidden behind it.
+            //
+            // Never relay transactions that we would assign a non-zero DoS
+            // score for, as we expect peers to do the same with us in that
+            // case.
+            int nDoS = 0;
+            if (!state.IsInvalid(nDoS) || nDoS == 0) {
+                LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
+                RelayTransaction(tx);
+            } else {
+                LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
+                    tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
+            }
+        }
+    }
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+    {
+        LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+            pfrom->id, pfrom->cleanSubVer,
+            state.GetRejectReason());
+        pfrom->PushMessage("reject", std::string("tx"), state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+        if (nDoS > 0)
+            Misbehaving(pfrom->GetId(), nDoS);
+    }
+}
+
+bool PrecheckTransaction(const CTransaction& tx, CValidationState& state, const CChainParams& chainparams, uint32_t& consensusBranchId)
+{
+    int nHeight = GetHeight() + 1;
+    consensusBranchId = CurrentEpochBranchId(nHeight, chainparams.GetConsensus());
+
+    auto verifier = libzelcash::ProofVerifier::Strict();
+    if (!CheckTransaction(tx, state, verifier))
+        return false;
+    // Same DoS level as in AcceptToMemoryPool, whose checks these replace
+    return ContextualCheckTransaction(tx, state, chainparams, nHeight, 10, false, true, IsInitialBlockDownload);
+}
+
+void CPeerTxCheckQueue::Push(CNode* pfrom, const CTransaction& tx)
+{
+    {
+        LOCK(cs_vNodes);
+        pfrom->AddRef();
+    }
+    pfrom->nTxChecksPending++;
+    boost::unique_lock<boost::mutex> lock(cs);
+    queue.push_back(Entry{pfrom, tx});
+    cond.notify_one();
+}
+
+CPeerTxCheckQueue::Entry CPeerTxCheckQueue::Take()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    std::list<Entry>::iterator it;
+    while (true) {
+        for (it = queue.begin(); it != queue.end() && setBusy.count(it->pfrom->GetId()); it++);
+        if (it != queue.end())
+            break;
+        cond.wait(lock);
+    }
+    Entry entry = *it;
+    queue.erase(it);
+    setBusy.insert(entry.pfrom->GetId());
+    return entry;
+}
+
+void CPeerTxCheckQueue::Finish(const Entry& entry)
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        setBusy.erase(entry.pfrom->GetId());
+        cond.notify_all();
+    }
+    entry.pfrom->nTxChecksPending--;
+    WakeMessageHandler();
+    {
+        LOCK(cs_vNodes);
+        entry.pfrom->Release();
+    }
+}
+
+void CPeerTxCheckQueue::ProcessNext(const CChainParams& chainparams)
+{
+    Entry entry = Take();
+    if (!entry.pfrom->fDisconnect) {
+        try {
+            // Don't spend a proof check on a transaction we have or rejected recently
+            bool fPrecheck = !entry.tx.IsCoinBase() && !entry.tx.IsZelnodeTx();
+            if (fPrecheck) {
+                LOCK(cs_main);
+                fPrecheck = !AlreadyHave(CInv(MSG_TX, entry.tx.GetHash()));
+            }
+            CValidationState state;
+            uint32_t consensusBranchId = 0;
+            if (fPrecheck)
+                PrecheckTransaction(entry.tx, state, chainparams, consensusBranchId);
+            ProcessTransaction(entry.pfrom, entry.tx, fPrecheck ? &state : NULL, consensusBranchId);
+        } catch (const boost::thread_interrupted&) {
+            Finish(entry);
+            throw;
+        } catch (const std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadCheckPeerTransactions()");
+        }
+    }
+    Finish(entry);
+}
+
+void CPeerTxCheckQueue::Thread()
+{
+    const CChainParams& chainparams = Params();
+    while (true)
+        ProcessNext(chainparams);
+}
+
+static CPeerTxCheckQueue peerTxCheckQueue;
+
+void ThreadCheckPeerTransactions() {
+    RenameThread("zelcash-txcheck");
+    peerTxCheckQueue.Thread();
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -6382,6 +7703,41 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SENDHEADERS_VERSION) {
+            // Tell our peer we prefer to receive headers rather than inv's
+            // We send this to non-NODE NETWORK peers as well, because even
+            // non-NODE NETWORK peers can announce blocks (such as pruning
+            // nodes)
+            pfrom->PushMessage("sendheaders");
+        }
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell our peer we can handle cmpctblock messages, but don't ask
+            // it to announce blocks with them until it gives us a new block.
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = 1;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -6508,9 +7864,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        // A new block will mostly consist of transactions we
+                        // already have, so ask for a compact one if we can.
+                        vToFetch.push_back(nodestate->fProvidesHeaderAndIDs ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -6636,6 +7994,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex is null if we sent up to our tip.
+        CNodeState *nodestate = State(pfrom->GetId());
+        nodestate->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -6646,133 +8007,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return false;
         }
 
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-
-        pfrom->setAskFor.erase(inv.hash);
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
-        {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s: accepted %s (poolsz %u)\n",
-                pfrom->id, pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
-            {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                        assert(recentRejects);
-                        recentRejects->insert(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
-            }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
-        }
-        // TODO: currently, prohibit joinsplits and shielded spends/outputs from entering mapOrphans
-        else if (fMissingInputs &&
-                 tx.vJoinSplit.empty() &&
-                 tx.vShieldedSpend.empty() &&
-                 tx.vShieldedOutput.empty())
-        {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+        if (nTxCheckThreads) {
+            peerTxCheckQueue.Push(pfrom, tx);
         } else {
-            assert(recentRejects);
-            recentRejects->insert(tx.GetHash());
-
-            if (pfrom->fWhitelisted) {
-                // Always relay transactions received from whitelisted peers, even
-                // if they were already in the mempool or rejected from it due
-                // to policy, allowing the node to function as a gateway for
-                // nodes hidden behind it.
-                //
-                // Never relay transactions that we would assign a non-zero DoS
-                // score for, as we expect peers to do the same with us in that
-                // case.
-                int nDoS = 0;
-                if (!state.IsInvalid(nDoS) || nDoS == 0) {
-                    LogPrintf("Force relaying tx %s from whitelisted peer=%d\n", tx.GetHash().ToString(), pfrom->id);
-                    RelayTransaction(tx);
-                } else {
-                    LogPrintf("Not relaying invalid transaction %s from whitelisted peer=%d (%s (code %d))\n",
-                        tx.GetHash().ToString(), pfrom->id, state.GetRejectReason(), state.GetRejectCode());
-                }
-            }
-        }
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-        {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            ProcessTransaction(pfrom, tx, NULL, 0);
         }
     }
 
@@ -6792,42 +8036,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             ReadCompactSize(vRecv); // ignore tx count; assume it is 0.
         }
 
-        LOCK(cs_main);
-
-        if (nCount == 0) {
-            // Nothing interesting. Stop asking this peers for more headers.
-            return true;
-        }
-
-        CBlockIndex *pindexLast = NULL;
-        BOOST_FOREACH(const CBlockHeader& header, headers) {
-            CValidationState state;
-            if (pindexLast != NULL && header.hashPrevBlock != pindexLast->GetBlockHash()) {
-                Misbehaving(pfrom->GetId(), 20);
-                return error("non-continuous headers sequence");
-            }
-            if (!AcceptBlockHeader(header, state, chainparams, &pindexLast)) {
-                int nDoS;
-                if (state.IsInvalid(nDoS)) {
-                    if (nDoS > 0)
-                        Misbehaving(pfrom->GetId(), nDoS);
-                    return error("invalid header received");
-                }
-            }
-        }
-
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
-
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
-            // Headers message had its maximum size; the peer may have more headers.
-            // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
-            // from there instead.
-            LogPrint("net", "more getheaders (%d) to end to peer=%d (startheight:%d)\n", pindexLast->nHeight, pfrom->id, pfrom->nStartingHeight);
-            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
-        }
-
-        CheckBlockIndex(chainparams.GetConsensus());
+        return ProcessHeaders(pfrom, headers, chainparams);
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
@@ -6840,23 +8049,226 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
-        CValidationState state;
         // Process all blocks from whitelisted peers, even if not requested,
         // unless we're still syncing with the network.
         // Such an unrequested block may still be processed, subject to the
         // conditions in AcceptBlock().
         bool forceProcessing = pfrom->fWhitelisted && !IsInitialBlockDownload(chainparams);
-        ProcessNewBlock(state, chainparams, pfrom, &block, forceProcessing, NULL);
-        int nDoS;
-        if (state.IsInvalid(nDoS)) {
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0) {
-                LOCK(cs_main);
-                Misbehaving(pfrom->GetId(), nDoS);
+        ProcessBlockFromPeer(pfrom, strCommand, block, forceProcessing, chainparams);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            return error("%s: cannot load block from disk", __func__);
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // Whether the block is reconstructed without a round-trip, and should be processed
+        bool fBlockReconstructed = false;
+        CBlock block;
+
+        {
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload(chainparams))
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                return true;
+            }
+        }
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+
+        // If AcceptBlockHeader returned true, it set pindex
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                pfrom->PushMessage("getdata", vInv);
             }
+            return true;
         }
 
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+            return true;
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                 (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                    if (!(*queuedBlockIt)->partialBlock)
+                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    else {
+                        // The block was already in flight using compact blocks from the same peer
+                        LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                        return true;
+                    }
+                } else {
+                    (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                }
+
+                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                    pfrom->PushMessage("getdata", vInv);
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    // Everything was in the mempool or prefilled
+                    status = partialBlock.FillBlock(block, std::vector<CTransaction>());
+                    if (status == READ_STATUS_OK) {
+                        fBlockReconstructed = true;
+                    } else {
+                        std::vector<CInv> vInv(1);
+                        vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                        pfrom->PushMessage("getdata", vInv);
+                        return true;
+                    }
+                } else {
+                    req.blockhash = pindex->GetBlockHash();
+                    pfrom->PushMessage("getblocktxn", req);
+                }
+            }
+        } else {
+            if (fAlreadyInFlight) {
+                // We requested this block, but its far into the future, so our
+                // mempool will probably be useless - request the block normally
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            } else {
+                // An announcement of a block too far ahead of our tip is
+                // treated like a headers message announcing it.
+                return ProcessHeaders(pfrom, std::vector<CBlockHeader>(1, cmpctblock.header), chainparams);
+            }
+        }
+        } // cs_main
+
+        if (fBlockReconstructed)
+            ProcessBlockFromPeer(pfrom, strCommand, block, true, chainparams);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+            if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                    it->second.first != pfrom->GetId()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+
+            PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+            ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Might have collided, fall back to getdata now :(
+                std::vector<CInv> invs;
+                invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", invs);
+                return true;
+            }
+        }
+
+        ProcessBlockFromPeer(pfrom, strCommand, block, true, chainparams);
     }
 
 
@@ -7156,6 +8568,10 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Let the transactions it sent before be checked first
+        if (pfrom->nTxChecksPending >= MAX_PEER_TX_CHECKS_PENDING)
+            break;
+
         // get next message
         CNetMessage& msg = *it;
 
@@ -7378,6 +8794,123 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other, e.g. because invalidateblock /
+                        // reconsiderblock was used repeatedly on the tip, adding
+                        // it to vBlockHashesToAnnounce more than once. Robustly
+                        // deal with this rare situation by reverting to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                std::shared_ptr<const CSerializeData> cmpctblock;
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                    // We only send up to 1 block as header-and-ids, as otherwise
+                    // probably means we're doing an initial-ish-sync or they're slow
+                    cmpctblock = GetCompactBlockMessage(pBestIndex, chainParams.GetConsensus());
+                }
+                if (cmpctblock) {
+                    LogPrint("net", "%s: sending header-and-ids %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                    pto->PushRawMessage(cmpctblock);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else if (state.fPreferHeaders) {
+                    if (vHeaders.size() > 1) {
+                        LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                                vHeaders.size(),
+                                vHeaders.front().GetHash().ToString(),
+                                vHeaders.back().GetHash().ToString(), pto->id);
+                    } else {
+                        LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                                vHeaders.front().GetHash().ToString(), pto->id);
+                    }
+                    pto->PushMessage("headers", vHeaders);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else
+                    fRevertToInv = true;
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    // If the peer's chain has this block, don't inv it back.
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
@@ -7389,7 +8922,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -7410,9 +8943,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                // skip duplicates within vInventoryToSend
+                if (!pto->filterInventoryKnown.contains(inv.hash))
                 {
+                    pto->filterInventoryKnown.insert(inv.hash);
                     vInv.push_back(inv);
                     if (vInv.size() >= 1000)
                     {
@@ -7428,10 +8962,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
 
         // Detect whether we're stalling
         int64_t nNow = GetTimeMicros();
-        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_DISCONNECT_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
-            // should only happen during initial block download.
+            // should only happen during initial block download. Before that, the blocks the peer holds up the
+            // window with are requested from faster peers if there are any, which resets this.
             LogPrintf("Peer=%d is stalling block download, disconnecting\n", pto->id);
             pto->fDisconnect = true;
         }
@@ -7462,10 +8997,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
-        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(chainParams)) && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+        // Peers get as many blocks in flight as they deliver in BLOCK_DOWNLOAD_QUEUE_TIME at the rate they
+        // have been delivering them.
+        int nBlocksInFlightQuota = GetBlockDownloadQuota(state.nBlockServiceTime);
+        if (!pto->fDisconnect && !pto->fClient && (fFetch || !IsInitialBlockDownload(chainParams)) && state.nBlocksInFlight < nBlocksInFlightQuota) {
             vector<CBlockIndex*> vToDownload;
             NodeId staller = -1;
-            FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            CBlockIndex* pindexStalled = NULL;
+            FindNextBlocksToDownload(pto->GetId(), nBlocksInFlightQuota - state.nBlocksInFlight, vToDownload, staller, pindexStalled);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
                 vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), consensusParams, pindex);
@@ -7473,9 +9012,26 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     pindex->nHeight, pto->id);
             }
             if (state.nBlocksInFlight == 0 && staller != -1) {
-                if (State(staller)->nStallingSince == 0) {
-                    State(staller)->nStallingSince = nNow;
+                CNodeState* stallerState = State(staller);
+                if (stallerState->nStallingSince == 0) {
+                    stallerState->nStallingSince = nNow;
                     LogPrint("net", "Stall started peer=%d\n", staller);
+                } else if (stallerState->nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT && pindexStalled) {
+                    // The staller's rate counts the time it has had the block so far.
+                    int64_t nRequested = mapBlocksInFlight[pindexStalled->GetBlockHash()].second->nTime;
+                    int64_t nStallerServiceTime = stallerState->nBlockServiceTime;
+                    UpdateAverageTime(nStallerServiceTime, nNow - std::max(nRequested, stallerState->nLastBlockReceived));
+                    // This peer has nothing to do, so it takes over the block that holds up the window if it is
+                    // known to be faster. Otherwise the staller is disconnected if it keeps stalling.
+                    if (state.nBlockServiceTime > 0 && state.nBlockServiceTime < nStallerServiceTime) {
+                        stallerState->nBlockServiceTime = nStallerServiceTime;
+                        stallerState->nBlocksStalled++;
+                        vGetData.push_back(CInv(MSG_BLOCK, pindexStalled->GetBlockHash()));
+                        // This also clears the stall mark of the staller, as it no longer holds up the window.
+                        MarkBlockAsInFlight(pto->GetId(), pindexStalled->GetBlockHash(), consensusParams, pindexStalled);
+                        LogPrint("net", "Requesting stalled block %s (%d) peer=%d instead of peer=%d\n", pindexStalled->GetBlockHash().ToString(),
+                            pindexStalled->nHeight, pto->id, staller);
+                    }
                 }
             }
         }
@@ -7522,11 +9078,10 @@ int GetInputAge(CTxIn& vin)
         CCoinsViewMemPool viewMempool(pcoinsTip, mempool);
         view.SetBackend(viewMempool); // temporarily switch cache backend to db+mempool view
 
-        const CCoins* coins = view.AccessCoins(vin.prevout.hash);
+        const Coin& coin = view.AccessCoin(vin.prevout);
 
-        if (coins) {
-            if (coins->nHeight < 0) return 0;
-            return (chainActive.Tip()->nHeight + 1) - coins->nHeight;
+        if (!coin.IsSpent()) {
+            return (chainActive.Tip()->nHeight + 1) - coin.nHeight;
         } else
             return -1;
     }
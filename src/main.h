@@ -33,6 +33,7 @@
 
 #include <algorithm>
 #include <exception>
+#include <list>
 #include <map>
 #include <set>
 #include <stdint.h>
@@ -47,8 +48,10 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewDB;
 class CChainParams;
 class CInv;
+class CSaplingCheck;
 class CScriptCheck;
 class CValidationInterface;
 class CValidationState;
@@ -78,6 +81,12 @@ static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -txcheckthreads, the number of threads checking transactions received from peers (0 = on the message handler thread) */
+static const int DEFAULT_TX_CHECK_THREADS = 2;
+/** Maximum number of -txcheckthreads. */
+static const int MAX_TX_CHECK_THREADS = 16;
 /** Default for -txexpirydelta, in number of blocks */
 static const unsigned int DEFAULT_TX_EXPIRY_DELTA = 20;
 /** The number of blocks within expiry height when a tx is considered to be expiring soon */
@@ -92,13 +101,28 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
-/** Number of blocks that can be requested at any given time from a single peer. */
+/** Number of blocks that can be requested at any given time from a single peer whose download rate is not known yet. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
-/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+/** Bounds on the number of blocks in flight from a single peer once its download rate is known. */
+static const int MIN_BLOCKS_IN_TRANSIT_PER_PEER = 2;
+static const int MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER = 64;
+/** Seconds of downloading, at the peer's measured rate, that the blocks in flight from a peer should cover. */
+static const unsigned int BLOCK_DOWNLOAD_QUEUE_TIME = 4;
+/** Timeout in seconds during which a peer must stall block download progress before the block it holds up is requested from another peer. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
+static const unsigned int BLOCK_STALLING_DISCONNECT_TIMEOUT = 30;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached its tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 160;
+/** Maximum number of headers to announce when relaying blocks with headers message.*/
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Every this many block announcements from a peer that don't connect to our headers, the peer is penalized. */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Number of trimmed Equihash solutions kept in memory after being read back for serving headers. */
+static const unsigned int SOLUTION_CACHE_SIZE = 2 * MAX_HEADERS_RESULTS;
+/** Number of recently served "block" messages kept ready to be sent to other peers. */
+static const unsigned int BLOCK_MESSAGE_CACHE_SIZE = 8;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -140,6 +164,8 @@ extern bool fExperimentalMode;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nPrefetchThreads;
+extern int nTxCheckThreads;
 extern bool fTxIndex;
 
 extern bool fIsVerifying;
@@ -227,6 +253,8 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
+/** Limit the number of block and undo files kept mapped for reading; 0 reads them with stdio only */
+void SetMaxMappedBlockFiles(size_t nMaxFiles);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos *dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
@@ -246,6 +274,14 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the Sapling proof checking thread */
+void ThreadSaplingCheck();
+/** Run an instance of the block header proof of work checking thread */
+void ThreadHeaderCheck();
+/** Run an instance of the thread reading coins for blocks about to be connected */
+void ThreadPrefetchCoins();
+/** Run an instance of the thread checking and accepting transactions received from peers */
+void ThreadCheckPeerTransactions();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(const CChainParams&), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -288,6 +324,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune);
 CBlockIndex * InsertBlockIndex(uint256 hash);
 /** Get statistics from node state */
 bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
+/** Number of blocks that may be in flight from a peer that spends nBlockServiceTime microseconds per block (0 if not known yet). */
+int GetBlockDownloadQuota(int64_t nBlockServiceTime);
 /** Increase a node's misbehavior score. */
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
@@ -295,15 +333,35 @@ void FlushStateToDisk();
 /** Prune block files and flush state to disk. */
 void PruneAndFlush();
 
-/** (try to) add transaction to memory pool **/
+/** (try to) add transaction to memory pool
+ *  If fProofsChecked, the proofs and signatures that ContextualCheckTransaction
+ *  verifies, and the JoinSplit proofs, were already verified for the next
+ *  block's consensus branch and are not checked again. **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fProofsChecked=false);
+/** (try to) add transaction to memory pool, entering it as if it had been received at nAcceptTime */
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false, bool fProofsChecked=false);
+
+/** Load the mempool saved by DumpMempool, re-validating its transactions against the current tip. */
+bool LoadMempool();
+/** Save the mempool, with its entry times and prioritisetransaction deltas, to mempool.dat. */
+bool DumpMempool();
+/** Whether startup is done loading the mempool, so that DumpMempool does not overwrite a saved mempool that was never loaded. */
+bool IsMempoolLoaded();
+/** Mark the mempool as loaded, whether or not a saved one was read. */
+void SetMempoolLoaded();
 
 struct CNodeStateStats {
     int nMisbehavior;
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    int nBlocksInFlightQuota;
+    int nBlocksDownloaded;
+    int nBlocksStalled;
+    int64_t nBlockServiceTime;
+    int64_t nBlockLatency;
 };
 
 
@@ -356,11 +414,14 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/** Check a transaction contextually against a set of consensus rules.
+ *  If pvSaplingChecks is not NULL, Sapling proof and signature checks are pushed
+ *  onto it instead of being performed inline. */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state,
                                 const CChainParams& chainparams, int nHeight, int dosLevel, bool fFromAccept,
                                 bool fFromMempool = false,
-                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)(const CChainParams&) = IsInitialBlockDownload,
+                                std::vector<CSaplingCheck> *pvSaplingChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -433,8 +494,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -454,6 +515,77 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the Sapling spend, output and binding signature checks
+ * of one transaction, so that the Sapling proofs of a whole block can be
+ * verified on the script check threads.
+ */
+class CSaplingCheck
+{
+private:
+    const CTransaction *ptx;
+    uint256 dataToBeSigned;
+
+public:
+    CSaplingCheck(): ptx(0) {}
+    CSaplingCheck(const CTransaction& txIn, const uint256& dataToBeSignedIn) :
+        ptx(&txIn), dataToBeSigned(dataToBeSignedIn) { }
+
+    bool operator()();
+
+    void swap(CSaplingCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+    }
+};
+
+/**
+ * Verify the proofs and signatures of tx that do not depend on the coins it
+ * spends for the next block, without holding cs_main. consensusBranchId is
+ * set to the branch they were verified for.
+ */
+bool PrecheckTransaction(const CTransaction& tx, CValidationState& state, const CChainParams& chainparams, uint32_t& consensusBranchId);
+/**
+ * Offer a transaction a peer sent us to the mempool, and relay it, resolve
+ * the orphans it was missing, or punish the peer for it. pstatePrecheck is
+ * the result of PrecheckTransaction for consensusBranchId, if it was run.
+ */
+void ProcessTransaction(CNode* pfrom, const CTransaction& tx, const CValidationState* pstatePrecheck, uint32_t consensusBranchId);
+
+/**
+ * Transactions received from peers, waiting for a -txcheckthreads worker to
+ * precheck them without cs_main and offer them to the mempool. The
+ * transactions of one peer are taken one at a time, in the order they were
+ * received, so that a peer sending many only keeps one worker busy.
+ */
+class CPeerTxCheckQueue
+{
+public:
+    struct Entry {
+        CNode* pfrom;
+        CTransaction tx;
+    };
+
+private:
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::list<Entry> queue;
+    //! Peers whose transaction a worker is processing.
+    std::set<NodeId> setBusy;
+
+public:
+    //! Queue a transaction pfrom sent, keeping a reference to pfrom until it is processed.
+    void Push(CNode* pfrom, const CTransaction& tx);
+    //! Take the oldest transaction of a peer that has none being processed, waiting until there is one.
+    Entry Take();
+    //! Release a taken transaction once it was processed.
+    void Finish(const Entry& entry);
+    //! Precheck and process the next transaction.
+    void ProcessNext(const CChainParams& chainparams);
+    //! Worker loop; returns when the thread is interrupted.
+    void Thread();
+};
+
 bool GetSpentIndex(CSpentIndexKey &key, CSpentIndexValue &value);
 bool GetAddressIndex(const uint160& addressHash, int type,
         std::vector<CAddressIndexDbEntry> &addressIndex,
@@ -467,6 +599,8 @@ bool GetTimestampIndex(unsigned int high, unsigned int low, bool fActiveOnly,
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
+/** Read the block hashBlock at pos, only checking its header if fTrustedHeader is not set. */
+bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const uint256& hashBlock, bool fTrustedHeader, const Consensus::Params& consensusParams);
 
 /** Functions for validating blocks and updating the block tree */
 
@@ -485,7 +619,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
 bool ContextualCheckBlockHeader(const CBlockHeader& block, CValidationState& state,
                                 const CChainParams& chainparams, CBlockIndex *pindexPrev);
 bool ContextualCheckBlock(const CBlock& block, CValidationState& state,
-                          const CChainParams& chainparams, CBlockIndex *pindexPrev, bool fComeFromAccept);
+                          const CChainParams& chainparams, CBlockIndex *pindexPrev, bool fComeFromAccept,
+                          std::vector<CSaplingCheck> *pvSaplingChecks = NULL);
 
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins.
  *  Validity checks that depend on the UTXO set are also done; ConnectBlock()
@@ -527,6 +662,9 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks (protected by cs_main). */
 extern CChain chainActive;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -0,0 +1,116 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+
+#include "util.h"
+
+#include <limits>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    munmap(const_cast<char*>(pdata), nSize);
+#endif
+}
+
+std::shared_ptr<const CMappedFile> CMappedFile::Open(const boost::filesystem::path& path)
+{
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > std::numeric_limits<size_t>::max()) {
+        close(fd);
+        return nullptr;
+    }
+    void* p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping holds its own reference to the file.
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrintf("Unable to map file %s\n", path.string());
+        return nullptr;
+    }
+    return std::shared_ptr<const CMappedFile>(new CMappedFile(static_cast<const char*>(p), (size_t)st.st_size));
+#else
+    // A mapped view would keep the file from being truncated or removed
+    // while it is still written to; readers fall back to stdio.
+    return nullptr;
+#endif
+}
+
+void CMappedFileCache::SetMaxFiles(size_t nMaxFilesIn)
+{
+    LOCK(cs);
+    nMaxFiles = nMaxFilesIn;
+    while (lru.size() > nMaxFiles) {
+        index.erase(lru.back().first);
+        lru.pop_back();
+    }
+}
+
+std::shared_ptr<const CMappedFile> CMappedFileCache::Get(const boost::filesystem::path& path, uint64_t nMinSize)
+{
+    const std::string strPath = path.string();
+    {
+        LOCK(cs);
+        if (nMaxFiles == 0)
+            return nullptr;
+        std::map<std::string, list_type::iterator>::iterator it = index.find(strPath);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            if (it->second->second->size() >= nMinSize)
+                return it->second->second;
+        }
+    }
+
+    // Map the file without holding the lock; a concurrent reader may do the
+    // same, in which case the last mapping is kept.
+    std::shared_ptr<const CMappedFile> file = CMappedFile::Open(path);
+    if (!file)
+        return nullptr;
+
+    LOCK(cs);
+    if (nMaxFiles == 0)
+        return nullptr;
+    std::map<std::string, list_type::iterator>::iterator it = index.find(strPath);
+    if (it != index.end()) {
+        it->second->second = file;
+        lru.splice(lru.begin(), lru, it->second);
+    } else {
+        lru.push_front(std::make_pair(strPath, file));
+        index[strPath] = lru.begin();
+        if (lru.size() > nMaxFiles) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+    if (file->size() < nMinSize)
+        return nullptr;
+    return file;
+}
+
+void CMappedFileCache::Erase(const boost::filesystem::path& path)
+{
+    LOCK(cs);
+    std::map<std::string, list_type::iterator>::iterator it = index.find(path.string());
+    if (it != index.end()) {
+        lru.erase(it->second);
+        index.erase(it);
+    }
+}
+
+size_t CMappedFileCache::size() const
+{
+    LOCK(cs);
+    return lru.size();
+}
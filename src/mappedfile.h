@@ -0,0 +1,86 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_MAPPEDFILE_H
+#define BITCOIN_MAPPEDFILE_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+
+/** Default for -maxmappedblockfiles; address space is too scarce for it on 32-bit systems. */
+static const unsigned int DEFAULT_MAX_MAPPED_BLOCK_FILES = sizeof(void*) >= 8 ? 64 : 0;
+
+/**
+ * A file mapped read-only into memory, as it was when it was opened. The
+ * mapping sees later writes to the part of the file it covers, but not
+ * what is appended past its end.
+ */
+class CMappedFile
+{
+private:
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+    const char* pdata;
+    size_t nSize;
+
+    CMappedFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+
+public:
+    ~CMappedFile();
+
+    //! Map the whole file at path. Returns null if it is missing or empty, or
+    //! cannot be mapped on this platform.
+    static std::shared_ptr<const CMappedFile> Open(const boost::filesystem::path& path);
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+};
+
+/**
+ * Keeps the most recently used files mapped, up to a number of files, so
+ * that repeated reads from them skip opening, seeking and reading. Handed
+ * out mappings stay valid for as long as they are referenced, even after
+ * being evicted.
+ */
+class CMappedFileCache
+{
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const CMappedFile> > > list_type;
+
+    mutable CCriticalSection cs;
+    size_t nMaxFiles;
+    //! Most recently used first.
+    list_type lru;
+    std::map<std::string, list_type::iterator> index;
+
+public:
+    explicit CMappedFileCache(size_t nMaxFilesIn = 0) : nMaxFiles(nMaxFilesIn) {}
+
+    //! Change the number of files kept mapped; 0 disables the cache.
+    void SetMaxFiles(size_t nMaxFilesIn);
+
+    //! Return a mapping of path that covers at least its first nMinSize
+    //! bytes, mapping the file again if it grew since it was last mapped.
+    //! Returns null if the cache is disabled, or the file cannot be mapped or
+    //! is too small.
+    std::shared_ptr<const CMappedFile> Get(const boost::filesystem::path& path, uint64_t nMinSize);
+
+    //! Forget the mapping of path, if any, e.g. before the file is truncated
+    //! or removed.
+    void Erase(const boost::filesystem::path& path);
+
+    size_t size() const;
+};
+
+#endif // BITCOIN_MAPPEDFILE_H
@@ -183,7 +183,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
                 // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
+                if (!view.HaveCoin(txin.prevout))
                 {
                     // This should never happen; all transactions in the memory
                     // pool should connect to either transactions in the chain
@@ -210,20 +210,20 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
                     nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
                     continue;
                 }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+                const Coin& coin = view.AccessCoin(txin.prevout);
+                assert(!coin.IsSpent());
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
+                CAmount nValueIn = coin.out.nValue;
                 nTotalIn += nValueIn;
 
-                int nConf = nHeight - coins->nHeight;
+                int nConf = nHeight - coin.nHeight;
 
                 dPriority += (double)nValueIn * nConf;
             }
 
             if (tx.IsZelnodeTx()) {
-                const CCoins* coins = view.AccessCoins(tx.collateralOut.hash);
-                if (!coins) {
+                const Coin& collateral = view.AccessCoin(tx.collateralOut);
+                if (collateral.IsSpent()) {
                     LogPrintf("Remove zelnode transaction because its collateral is not found. %s\n", tx.GetHash().GetHex());
                     std::list<CTransaction> removed;
                     mempool.remove(tx, removed, false);
@@ -264,7 +264,7 @@ CBlockTemplate* CreateNewBlock(const CChainParams& chainparams, const CScript& s
                 }
 
 
-                int nConf = nHeight - coins->nHeight;
+                int nConf = nHeight - collateral.nHeight;
 
                 dPriority += (double)100 * nConf;
             }
@@ -22,6 +22,11 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
 #endif
 
 #include <boost/filesystem.hpp>
@@ -49,6 +54,8 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 16;
+    /** Maximum number of queued messages handed to the kernel in one send call. */
+    const int MAX_SEND_IOVECS = 64;
 
     struct ListenSocket {
         SOCKET socket;
@@ -70,6 +77,12 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef HAVE_SYS_EPOLL_H
+//! epoll instance the socket handler waits on, or -1 if it uses select().
+static int hSocketEvents = -1;
+//! Set in the epoll data of listening sockets, which holds a node id otherwise.
+static const uint64_t SOCKET_EVENTS_LISTEN_FLAG = 1ULL << 63;
+#endif
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -77,7 +90,7 @@ std::string strSubVersion;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, std::shared_ptr<const CSerializeData> > mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -445,7 +458,7 @@ void CNode::PushVersion()
 
 
 
-std::map<CSubNet, int64_t> CNode::setBanned;
+CSubNetMap<int64_t> CNode::setBanned;
 CCriticalSection CNode::cs_setBanned;
 
 void CNode::ClearBanned()
@@ -456,19 +469,9 @@ void CNode::ClearBanned()
 
 bool CNode::IsBanned(CNetAddr ip)
 {
-    bool fResult = false;
-    {
-        LOCK(cs_setBanned);
-        for (std::map<CSubNet, int64_t>::iterator it = setBanned.begin(); it != setBanned.end(); it++)
-        {
-            CSubNet subNet = (*it).first;
-            int64_t t = (*it).second;
-
-            if(subNet.Match(ip) && GetTime() < t)
-                fResult = true;
-        }
-    }
-    return fResult;
+    const int64_t nNow = GetTime();
+    LOCK(cs_setBanned);
+    return setBanned.AnyMatch(ip, [nNow](int64_t t) { return nNow < t; });
 }
 
 bool CNode::IsBanned(CSubNet subnet)
@@ -476,7 +479,7 @@ bool CNode::IsBanned(CSubNet subnet)
     bool fResult = false;
     {
         LOCK(cs_setBanned);
-        std::map<CSubNet, int64_t>::iterator i = setBanned.find(subnet);
+        CSubNetMap<int64_t>::const_iterator i = setBanned.find(subnet);
         if (i != setBanned.end())
         {
             int64_t t = (*i).second;
@@ -517,25 +520,21 @@ bool CNode::Unban(const CSubNet &subNet) {
 void CNode::GetBanned(std::map<CSubNet, int64_t> &banMap)
 {
     LOCK(cs_setBanned);
-    banMap = setBanned; //create a thread safe copy
+    banMap = setBanned.get(); //create a thread safe copy
 }
 
 
-std::vector<CSubNet> CNode::vWhitelistedRange;
-CCriticalSection CNode::cs_vWhitelistedRange;
+CSubNetMap<bool> CNode::setWhitelistedRange;
+CCriticalSection CNode::cs_setWhitelistedRange;
 
 bool CNode::IsWhitelistedRange(const CNetAddr &addr) {
-    LOCK(cs_vWhitelistedRange);
-    BOOST_FOREACH(const CSubNet& subnet, vWhitelistedRange) {
-        if (subnet.Match(addr))
-            return true;
-    }
-    return false;
+    LOCK(cs_setWhitelistedRange);
+    return setWhitelistedRange.AnyMatch(addr, [](bool fWhitelisted) { return fWhitelisted; });
 }
 
 void CNode::AddWhitelistedRange(const CSubNet &subnet) {
-    LOCK(cs_vWhitelistedRange);
-    vWhitelistedRange.push_back(subnet);
+    LOCK(cs_setWhitelistedRange);
+    setWhitelistedRange[subnet] = true;
 }
 
 void CNode::copyStats(CNodeStats &stats)
@@ -553,6 +552,8 @@ void CNode::copyStats(CNodeStats &stats)
     stats.nStartingHeight = nStartingHeight;
     stats.nSendBytes = nSendBytes;
     stats.nRecvBytes = nRecvBytes;
+    stats.nSendCalls = nSendCalls;
+    stats.nSendPartial = nSendPartial;
     stats.fWhitelisted = fWhitelisted;
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -671,23 +672,57 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<std::shared_ptr<const CSerializeData> >::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
+        size_t nToSend = 0;
+#ifdef WIN32
+        const CSerializeData &data = **it;
         assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        nToSend = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nToSend, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Hand the queued messages to the kernel in one call, straight from
+        // their (possibly shared) buffers.
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<std::shared_ptr<const CSerializeData> >::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; ++itIov) {
+            const CSerializeData &data = **itIov;
+            assert(data.size() > nOffset);
+            iov[nIov].iov_base = const_cast<char*>(&data[nOffset]);
+            iov[nIov].iov_len = data.size() - nOffset;
+            nToSend += iov[nIov].iov_len;
+            nIov++;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+        pnode->nSendCalls++;
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                const CSerializeData &data = **it;
+                size_t nLeft = data.size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
+            }
+            if ((size_t)nBytes < nToSend) {
+                // could not send everything; wait until the socket is writable again
+                pnode->nSendPartial++;
                 break;
             }
         } else {
@@ -928,7 +963,11 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsSelectableSocket(hSocket)
+#ifdef HAVE_SYS_EPOLL_H
+        && hSocketEvents == -1
+#endif
+        )
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -973,8 +1012,219 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/**
+ * Whether the socket handler should send data to the node, or receive data
+ * from it.
+ */
+static void GetSocketInterest(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    // Implement the following logic:
+    // * If there is data to send, select() for sending data. As this only
+    //   happens when optimistic write failed, we choose to first drain the
+    //   write buffer in this case before receiving more. This avoids
+    //   needlessly queueing received data, if the remote peer is not themselves
+    //   receiving data. This means properly utilizing TCP flow control signaling.
+    // * Otherwise, if there is no (complete) message in the receive buffer,
+    //   or there is space left in the buffer, select() for receiving data.
+    // * (if neither of the above applies, there is certainly one message
+    //   in the receiver buffer ready to be processed).
+    // Together, that means that at least one of the following is always possible,
+    // so we don't deadlock:
+    // * We send some data.
+    // * We wait for data to be received (and disconnect after timeout).
+    // * We process a message in the buffer (message handler thread).
+    fWantSend = false;
+    fWantRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+/**
+ * Wait up to timeout ms for sockets to become ready with select(), and
+ * return which listening sockets have a connection to accept and which nodes
+ * can be received from or sent to.
+ */
+static void SocketEventsSelect(const vector<CNode*>& vNodesCopy, int timeout, vector<bool>& vListenReady, set<CNode*>& setRecv, set<CNode*>& setSend)
+{
+    struct timeval tv;
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        // Sockets accepted while epoll was in use may not fit in an fd_set.
+        if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+            continue;
+        FD_SET(pnode->hSocket, &fdsetError);
+        hSocketMax = max(hSocketMax, pnode->hSocket);
+        have_fds = true;
+
+        bool fWantSend, fWantRecv;
+        GetSocketInterest(pnode, fWantSend, fWantRecv);
+        if (fWantSend)
+            FD_SET(pnode->hSocket, &fdsetSend);
+        else if (fWantRecv)
+            FD_SET(pnode->hSocket, &fdsetRecv);
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &tv);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            for (unsigned int i = 0; i <= hSocketMax; i++)
+                FD_SET(i, &fdsetRecv);
+        }
+        FD_ZERO(&fdsetSend);
+        FD_ZERO(&fdsetError);
+        MilliSleep(timeout);
+    }
+
+    vListenReady.assign(vhListenSocket.size(), false);
+    for (size_t i = 0; i < vhListenSocket.size(); i++)
+        vListenReady[i] = vhListenSocket[i].socket != INVALID_SOCKET && FD_ISSET(vhListenSocket[i].socket, &fdsetRecv);
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET || !IsSelectableSocket(pnode->hSocket))
+            continue;
+        if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            setRecv.insert(pnode);
+        if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            setSend.insert(pnode);
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Same as SocketEventsSelect, with epoll. Sockets are registered once and
+ * edge-triggered, so waiting does not cost a pass over all of them in the
+ * kernel; their readiness is kept in the nodes until it is used up.
+ */
+static void SocketEventsEpoll(const vector<CNode*>& vNodesCopy, int timeout, vector<bool>& vListenReady, set<CNode*>& setRecv, set<CNode*>& setSend)
+{
+    // Don't wait if a node can already make progress.
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (!pnode->fSocketRegistered) {
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            event.data.u64 = pnode->id;
+            // The socket number may still be registered for a socket that
+            // was closed while shared with a forked child.
+            if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0 &&
+                (errno != EEXIST || epoll_ctl(hSocketEvents, EPOLL_CTL_MOD, pnode->hSocket, &event) != 0)) {
+                LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(WSAGetLastError()));
+                pnode->CloseSocketDisconnect();
+                continue;
+            }
+            pnode->fSocketRegistered = true;
+        }
+        bool fWantSend, fWantRecv;
+        GetSocketInterest(pnode, fWantSend, fWantRecv);
+        if ((fWantSend && pnode->fSendReady) || (fWantRecv && pnode->fRecvReady))
+            timeout = 0;
+    }
+
+    vListenReady.assign(vhListenSocket.size(), false);
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hSocketEvents, events, ARRAYLEN(events), timeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(WSAGetLastError()));
+            MilliSleep(timeout);
+        }
+        nEvents = 0;
+    }
+
+    // Events only refer to nodes by id, as one may be reported for a socket
+    // that another thread closed since.
+    map<NodeId, CNode*> mapNodes;
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+        mapNodes[pnode->id] = pnode;
+    for (int i = 0; i < nEvents; i++) {
+        if (events[i].data.u64 & SOCKET_EVENTS_LISTEN_FLAG) {
+            size_t nListen = events[i].data.u64 & ~SOCKET_EVENTS_LISTEN_FLAG;
+            if (nListen < vListenReady.size())
+                vListenReady[nListen] = true;
+            continue;
+        }
+        map<NodeId, CNode*>::iterator it = mapNodes.find((NodeId)events[i].data.u64);
+        if (it == mapNodes.end())
+            continue;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            it->second->fRecvReady = true;
+        if (events[i].events & EPOLLOUT)
+            it->second->fSendReady = true;
+    }
+
+    BOOST_FOREACH(CNode* pnode, vNodesCopy)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        bool fWantSend, fWantRecv;
+        GetSocketInterest(pnode, fWantSend, fWantRecv);
+        if (fWantSend && pnode->fSendReady)
+            setSend.insert(pnode);
+        else if (fWantRecv && pnode->fRecvReady)
+            setRecv.insert(pnode);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
+#ifdef HAVE_SYS_EPOLL_H
+    hSocketEvents = epoll_create1(EPOLL_CLOEXEC);
+    for (size_t i = 0; hSocketEvents != -1 && i < vhListenSocket.size(); i++) {
+        // Level-triggered, as not every connection may be accepted at once.
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = SOCKET_EVENTS_LISTEN_FLAG | i;
+        if (epoll_ctl(hSocketEvents, EPOLL_CTL_ADD, vhListenSocket[i].socket, &event) != 0) {
+            close(hSocketEvents);
+            hSocketEvents = -1;
+        }
+    }
+    if (hSocketEvents == -1)
+        LogPrintf("Unable to use epoll (%s), falling back to select()\n", NetworkErrorString(WSAGetLastError()));
+#endif
+
     unsigned int nPrevNodeCount = 0;
     while (true)
     {
@@ -1041,109 +1291,42 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
-        //
-        // Find which sockets have data to receive
-        //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
+        vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signaling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
         }
 
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        //
+        // Find which sockets have data to receive
+        //
+        int timeout = 50; // frequency to poll pnode->vSend, in milliseconds
+        vector<bool> vListenReady;
+        set<CNode*> setRecv;
+        set<CNode*> setSend;
+#ifdef HAVE_SYS_EPOLL_H
+        if (hSocketEvents != -1)
+            SocketEventsEpoll(vNodesCopy, timeout, vListenReady, setRecv, setSend);
+        else
+#endif
+            SocketEventsSelect(vNodesCopy, timeout, vListenReady, setRecv, setSend);
 
         //
         // Accept new connections
         //
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+        for (size_t i = 0; i < vhListenSocket.size(); i++)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (vListenReady[i])
             {
-                AcceptConnection(hListenSocket);
+                AcceptConnection(vhListenSocket[i]);
             }
         }
 
         //
         // Service each socket
         //
-        vector<CNode*> vNodesCopy;
-        {
-            LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
-                pnode->AddRef();
-        }
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
@@ -1153,7 +1336,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (setRecv.count(pnode))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1162,6 +1345,8 @@ void ThreadSocketHandler()
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
                         int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // A short read means the socket was drained.
+                        pnode->fRecvReady = nBytes == (int)sizeof(pchBuf);
                         if (nBytes > 0)
                         {
                             if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
@@ -1197,11 +1382,14 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (setSend.count(pnode))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Data left over means the socket buffer is full.
+                    pnode->fSendReady = pnode->vSendMsg.empty();
+                }
             }
 
             //
@@ -1524,6 +1712,11 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1561,7 +1754,7 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
-                    if (pnode->nSendSize < SendBufferSize())
+                    if (pnode->nSendSize < SendBufferSize() && pnode->nTxChecksPending < MAX_PEER_TX_CHECKS_PENDING)
                     {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
@@ -1830,6 +2023,12 @@ public:
             if (hListenSocket.socket != INVALID_SOCKET)
                 if (!CloseSocket(hListenSocket.socket))
                     LogPrintf("CloseSocket(hListenSocket) failed with error %s\n", NetworkErrorString(WSAGetLastError()));
+#ifdef HAVE_SYS_EPOLL_H
+        if (hSocketEvents != -1) {
+            close(hSocketEvents);
+            hSocketEvents = -1;
+        }
+#endif
 
         // clean up some globals (to help leak detection)
         BOOST_FOREACH(CNode *pnode, vNodes)
@@ -1878,8 +2077,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // as a complete message shared by every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, CreateMessage("tx", ss)));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
     LOCK(cs_vNodes);
@@ -2087,7 +2287,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2112,6 +2312,8 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendCalls = 0;
+    nSendPartial = 0;
     hashContinue = uint256();
     nStartingHeight = -1;
     fGetAddr = false;
@@ -2123,6 +2325,10 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nPingUsecTime = 0;
     fPingQueued = false;
     nMinPingUsecTime = std::numeric_limits<int64_t>::max();
+    fSocketRegistered = false;
+    fRecvReady = false;
+    fSendReady = false;
+    nTxChecksPending = 0;
 
     {
         LOCK(cs_nLastNodeId);
@@ -2185,11 +2391,34 @@ void CNode::AskFor(const CInv& inv)
     mapAskFor.insert(std::make_pair(nRequestTime, inv));
 }
 
+void WriteMessageHeader(CDataStream& ss, const char* pszCommand)
+{
+    ss << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+}
+
+std::shared_ptr<const CSerializeData> FinalizeMessage(CDataStream& ss)
+{
+    // Set the size
+    assert(ss.size() >= CMessageHeader::HEADER_SIZE);
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+
+    std::shared_ptr<CSerializeData> msg = std::make_shared<CSerializeData>();
+    ss.GetAndClear(*msg);
+    return msg;
+}
+
 void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend)
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
-    ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
+    WriteMessageHeader(ssSend, pszCommand);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
 
@@ -2221,26 +2450,32 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         LEAVE_CRITICAL_SECTION(cs_vSend);
         return;
     }
-    // Set the size
     unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    WriteLE32((uint8_t*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
-
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
-
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    std::shared_ptr<const CSerializeData> msg = FinalizeMessage(ssSend);
+    nSendSize += msg->size();
+    vSendMsg.push_back(msg);
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
 
     LEAVE_CRITICAL_SECTION(cs_vSend);
 }
+
+void CNode::PushRawMessage(const std::shared_ptr<const CSerializeData>& msg)
+{
+    LOCK(cs_vSend);
+    assert(msg->size() >= CMessageHeader::HEADER_SIZE);
+    const char* pszCommand = &(*msg)[MESSAGE_START_SIZE];
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(std::string(pszCommand, strnlen(pszCommand, CMessageHeader::COMMAND_SIZE))),
+             msg->size() - CMessageHeader::HEADER_SIZE, id);
+
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
+}
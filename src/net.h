@@ -10,16 +10,18 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
+#include "subnetmap.h"
 #include "sync.h"
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
+#include <memory>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -61,6 +63,10 @@ static const size_t SETASKFOR_MAX_SZ = 2 * MAX_INV_SZ;
 static const unsigned int DEFAULT_MAX_PEER_CONNECTIONS = 125;
 /** The period before a network upgrade activates, where connections to upgrading peers are preferred (in blocks). */
 static const int NETWORK_UPGRADE_PEER_PREFERENCE_BLOCK_PERIOD = 24 * 24 * 3;
+/** The number of transactions from a peer that may wait to be checked before its further messages are held back. */
+static const int MAX_PEER_TX_CHECKS_PENDING = 64;
+/** The number of most recent inventory items a peer is known to have that are remembered, so they are not announced to it again. */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 10000;
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -76,9 +82,26 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhitelisted = false);
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
+/** Let the message handler thread look for messages to process before its next poll. */
+void WakeMessageHandler();
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** Start a message with the given command; its size and checksum are set by FinalizeMessage. */
+void WriteMessageHeader(CDataStream& ss, const char* pszCommand);
+/** Complete the message header in ss and move the message into a buffer that can be queued for any peer. */
+std::shared_ptr<const CSerializeData> FinalizeMessage(CDataStream& ss);
+
+/** Serialize a message once, to be queued for each peer it is sent to with CNode::PushRawMessage. */
+template<typename T>
+std::shared_ptr<const CSerializeData> CreateMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    WriteMessageHeader(ss, pszCommand);
+    ss << obj;
+    return FinalizeMessage(ss);
+}
+
 typedef int NodeId;
 
 struct CombinerAll
@@ -147,7 +170,8 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+//! Complete "tx" messages of recently relayed transactions, shared by the peers that request them.
+extern std::map<CInv, std::shared_ptr<const CSerializeData> > mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -185,6 +209,8 @@ public:
     int nStartingHeight;
     uint64_t nSendBytes;
     uint64_t nRecvBytes;
+    uint64_t nSendCalls;
+    uint64_t nSendPartial;
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -247,7 +273,10 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    uint64_t nSendCalls; // number of send calls made
+    uint64_t nSendPartial; // number of send calls that could not take all queued data
+    //! Messages may be shared between peers, e.g. the same block sent to many
+    std::deque<std::shared_ptr<const CSerializeData> > vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -287,19 +316,27 @@ public:
     CBloomFilter* pfilter;
     int nRefCount;
     NodeId id;
+    // Socket readiness as reported by edge-triggered epoll, which does not
+    // report it again until the socket was drained or filled up. Only used by
+    // the socket handler thread.
+    bool fSocketRegistered;
+    bool fRecvReady;
+    bool fSendReady;
+    // Transactions from this peer waiting to be checked on another thread.
+    std::atomic<int> nTxChecksPending;
 protected:
 
     // Denial-of-service detection/prevention
     // Key is IP address, value is banned-until-time
-    static std::map<CSubNet, int64_t> setBanned;
+    static CSubNetMap<int64_t> setBanned;
     static CCriticalSection cs_setBanned;
 
     std::set<std::string> setRequestsFulfilled; //keep track of what client has asked for
 
     // Whitelisted ranges. Any node connecting from these is automatically
     // whitelisted (as well as those connecting to whitelisted binds).
-    static std::vector<CSubNet> vWhitelistedRange;
-    static CCriticalSection cs_vWhitelistedRange;
+    static CSubNetMap<bool> setWhitelistedRange;
+    static CCriticalSection cs_setWhitelistedRange;
 
     // Basic fuzz-testing
     void Fuzz(int nChance); // modifies ssSend
@@ -315,8 +352,10 @@ public:
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
+    // Set of block hashes to announce, with headers if the peer prefers that
+    std::vector<uint256> vBlockHashesToAnnounce;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -418,7 +457,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -426,11 +465,17 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -444,6 +489,10 @@ public:
 
     void PushVersion();
 
+    //! Queue a complete message, header included, that may also be queued
+    //! for other peers.
+    void PushRawMessage(const std::shared_ptr<const CSerializeData>& msg);
+
 
     void PushMessage(const char* pszCommand)
     {
@@ -1314,6 +1314,24 @@ bool CSubNet::Match(const CNetAddr &addr) const
     return true;
 }
 
+const CNetAddr& CSubNet::GetNetwork() const
+{
+    return network;
+}
+
+int CSubNet::GetPrefixLength() const
+{
+    if (!valid)
+        return -1;
+    int n = 0;
+    while (n < 128 && (netmask[n >> 3] & (1 << (7 - (n & 7)))))
+        n++;
+    for (int x = n; x < 128; ++x)
+        if (netmask[x >> 3] & (1 << (7 - (x & 7))))
+            return -1;
+    return n;
+}
+
 std::string CSubNet::ToString() const
 {
     std::string strNetmask;
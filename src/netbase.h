@@ -123,6 +123,13 @@ class CSubNet
         std::string ToString() const;
         bool IsValid() const;
 
+        /// Network (base) address, with the bits outside the netmask cleared
+        const CNetAddr& GetNetwork() const;
+        /// Number of leading address bits the netmask covers, counting the
+        /// IPv4 prefix for IPv4 subnets, or -1 if the subnet is invalid or
+        /// the netmask is not a prefix
+        int GetPrefixLength() const;
+
         friend bool operator==(const CSubNet& a, const CSubNet& b);
         friend bool operator!=(const CSubNet& a, const CSubNet& b);
         friend bool operator<(const CSubNet& a, const CSubNet& b);
@@ -235,19 +235,15 @@ bool CheckEquihashSolution(const CBlockHeader *pblock, const Consensus::Params&
 
     //need to put block height param switching code here
 
-    // Hash state
-    crypto_generichash_blake2b_state state;
-    EhInitialiseState(n, k, state);
     // I = the block header minus nonce and solution.
     CEquihashInput I{*pblock};
     // I||V
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
     ss << I;
     ss << pblock->nNonce;
-    // H(I||V||...
-    crypto_generichash_blake2b_update(&state, (unsigned char*)&ss[0], ss.size());
+    // H(I||V||..., with the leaf hashes finished in multi-lane batches
     bool isValid;
-    EhIsValidSolution(n, k, state, pblock->nSolution, isValid);
+    EhIsValidSolutionForInput(n, k, (unsigned char*)&ss[0], ss.size(), pblock->nSolution, isValid);
     if (!isValid)
         return error("CheckEquihashSolution(): invalid solution");
 
@@ -24,7 +24,8 @@ static const char* ppszTypeName[] =
     "zn quorum",
     "zn announce",
     "zn ping",
-    "dstx"
+    "dstx",
+    "cmpctblock"
 };
 
 CMessageHeader::CMessageHeader(const MessageStartChars& pchMessageStartIn)
@@ -138,7 +139,7 @@ bool CInv::IsKnownType() const
 
 bool CInv::IsZelnodeType() const
 {
-    return (type >= 4);
+    return (type >= 4 && type < MSG_CMPCT_BLOCK);
 }
 
 const char* CInv::GetCommand() const
@@ -159,7 +159,10 @@ enum {
     MSG_BLOCK,
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
-    MSG_FILTERED_BLOCK
+    MSG_FILTERED_BLOCK,
+    // Types 4 to 10 are the legacy zelnode inventory types.
+    // Only used in getdata, for blocks near the tip, to ask for a "cmpctblock".
+    MSG_CMPCT_BLOCK = 11
 };
 
 #endif // BITCOIN_PROTOCOL_H
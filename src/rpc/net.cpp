@@ -92,6 +92,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"lastrecv\": ttt,           (numeric) The time in seconds since epoch (Jan 1 1970 GMT) of the last receive\n"
             "    \"bytessent\": n,            (numeric) The total bytes sent\n"
             "    \"bytesrecv\": n,            (numeric) The total bytes received\n"
+            "    \"sendcalls\": n,            (numeric) The number of send calls made\n"
+            "    \"sendpartial\": n,          (numeric) The number of send calls that could not take all queued data\n"
             "    \"conntime\": ttt,           (numeric) The connection time in seconds since epoch (Jan 1 1970 GMT)\n"
             "    \"timeoffset\": ttt,         (numeric) The time offset in seconds\n"
             "    \"pingtime\": n,             (numeric) ping time\n"
@@ -106,7 +108,12 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"inflight_quota\": n,       (numeric) The number of blocks we ask from this peer at a time\n"
+            "    \"blocks_downloaded\": n,    (numeric) The number of blocks this peer delivered at our request\n"
+            "    \"blocks_stalled\": n,       (numeric) The number of blocks asked from another peer as this peer stalled\n"
+            "    \"block_time\": n,           (numeric) The average time in seconds this peer takes per block\n"
+            "    \"block_latency\": n,        (numeric) The average time in seconds from requesting a block to receiving it\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -135,6 +142,8 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         obj.pushKV("lastrecv", stats.nLastRecv);
         obj.pushKV("bytessent", stats.nSendBytes);
         obj.pushKV("bytesrecv", stats.nRecvBytes);
+        obj.pushKV("sendcalls", stats.nSendCalls);
+        obj.pushKV("sendpartial", stats.nSendPartial);
         obj.pushKV("conntime", stats.nTimeConnected);
         obj.pushKV("timeoffset", stats.nTimeOffset);
         obj.pushKV("pingtime", stats.dPingTime);
@@ -156,6 +165,11 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.pushKV("inflight", heights);
+            obj.pushKV("inflight_quota", statestats.nBlocksInFlightQuota);
+            obj.pushKV("blocks_downloaded", statestats.nBlocksDownloaded);
+            obj.pushKV("blocks_stalled", statestats.nBlocksStalled);
+            obj.pushKV("block_time", ((double)statestats.nBlockServiceTime) / 1e6);
+            obj.pushKV("block_latency", ((double)statestats.nBlockLatency) / 1e6);
         }
         obj.pushKV("whitelisted", stats.fWhitelisted);
 
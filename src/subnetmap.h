@@ -0,0 +1,166 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SUBNETMAP_H
+#define BITCOIN_SUBNETMAP_H
+
+#include "netbase.h"
+
+#include <assert.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+/**
+ * STL-like map from subnets to values that finds the subnets containing an
+ * address by walking a binary trie over the address bits, so a lookup takes
+ * at most 128 steps however many subnets are stored. Subnets whose netmask is
+ * not a prefix are rare and are matched one by one.
+ */
+template <typename T>
+class CSubNetMap
+{
+public:
+    typedef std::map<CSubNet, T> map_type;
+    typedef typename map_type::iterator iterator;
+    typedef typename map_type::const_iterator const_iterator;
+    typedef typename map_type::size_type size_type;
+
+protected:
+    struct Node
+    {
+        std::unique_ptr<Node> children[2];
+        //! The entry of the subnet with the prefix leading to this node, if any
+        iterator entry;
+        bool fEntry;
+
+        Node() : fEntry(false) {}
+    };
+
+    map_type mapEntries;
+    Node root;
+    std::vector<iterator> vOther;
+
+    static int GetBit(const CNetAddr& addr, int n)
+    {
+        return (addr.GetByte(15 - n / 8) >> (7 - n % 8)) & 1;
+    }
+
+    void Index(iterator it)
+    {
+        const int nPrefix = it->first.GetPrefixLength();
+        if (nPrefix < 0) {
+            vOther.push_back(it);
+            return;
+        }
+        const CNetAddr network = it->first.GetNetwork();
+        Node* node = &root;
+        for (int n = 0; n < nPrefix; n++) {
+            std::unique_ptr<Node>& child = node->children[GetBit(network, n)];
+            if (!child)
+                child.reset(new Node());
+            node = child.get();
+        }
+        node->entry = it;
+        node->fEntry = true;
+    }
+
+    void Unindex(iterator it)
+    {
+        const int nPrefix = it->first.GetPrefixLength();
+        if (nPrefix < 0) {
+            for (typename std::vector<iterator>::iterator itOther = vOther.begin(); itOther != vOther.end(); itOther++) {
+                if (*itOther == it) {
+                    vOther.erase(itOther);
+                    return;
+                }
+            }
+            assert(!"subnet missing from index");
+        }
+        const CNetAddr network = it->first.GetNetwork();
+        std::vector<Node*> vPath;
+        Node* node = &root;
+        for (int n = 0; n < nPrefix; n++) {
+            vPath.push_back(node);
+            node = node->children[GetBit(network, n)].get();
+            assert(node);
+        }
+        assert(node->fEntry && node->entry == it);
+        node->fEntry = false;
+        // Drop the nodes that no longer lead to any subnet
+        for (int n = nPrefix - 1; n >= 0; n--) {
+            Node* child = vPath[n]->children[GetBit(network, n)].get();
+            if (child->fEntry || child->children[0] || child->children[1])
+                break;
+            vPath[n]->children[GetBit(network, n)].reset();
+        }
+    }
+
+public:
+    CSubNetMap() {}
+
+    const_iterator begin() const { return mapEntries.begin(); }
+    const_iterator end() const { return mapEntries.end(); }
+    size_type size() const { return mapEntries.size(); }
+    bool empty() const { return mapEntries.empty(); }
+    const_iterator find(const CSubNet& subnet) const { return mapEntries.find(subnet); }
+    size_type count(const CSubNet& subnet) const { return mapEntries.count(subnet); }
+    //! The entries ordered by subnet, as a plain map.
+    const map_type& get() const { return mapEntries; }
+
+    T& operator[](const CSubNet& subnet)
+    {
+        std::pair<iterator, bool> ret = mapEntries.insert(std::make_pair(subnet, T()));
+        if (ret.second)
+            Index(ret.first);
+        return ret.first->second;
+    }
+
+    size_type erase(const CSubNet& subnet)
+    {
+        iterator it = mapEntries.find(subnet);
+        if (it == mapEntries.end())
+            return 0;
+        Unindex(it);
+        mapEntries.erase(it);
+        return 1;
+    }
+
+    void clear()
+    {
+        vOther.clear();
+        root.children[0].reset();
+        root.children[1].reset();
+        root.fEntry = false;
+        mapEntries.clear();
+    }
+
+    /** Whether pred holds for the value of any subnet containing addr. */
+    template <typename Predicate>
+    bool AnyMatch(const CNetAddr& addr, Predicate pred) const
+    {
+        if (!addr.IsValid())
+            return false;
+        const Node* node = &root;
+        for (int n = 0; node; n++) {
+            if (node->fEntry && pred(node->entry->second))
+                return true;
+            if (n == 128)
+                break;
+            node = node->children[GetBit(addr, n)].get();
+        }
+        for (typename std::vector<iterator>::const_iterator it = vOther.begin(); it != vOther.end(); it++) {
+            if ((*it)->first.Match(addr) && pred((*it)->second))
+                return true;
+        }
+        return false;
+    }
+
+private:
+    // The index holds iterators into this object's own map.
+    CSubNetMap(const CSubNetMap&);
+    CSubNetMap& operator=(const CSubNetMap&);
+};
+
+#endif // BITCOIN_SUBNETMAP_H
@@ -21,6 +21,10 @@
 
 #include <stdint.h>
 
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/foreach.hpp>
@@ -110,6 +114,44 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(DoS_unconnecting_headers)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode dummyNode(fds[0], CAddress(ip(0xa0b0c003)), "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+
+    // Announcements whose parent we don't have are answered with a
+    // getheaders, and only every MAX_UNCONNECTING_HEADERS-th is penalized
+    for (int i = 1; i <= 2 * MAX_UNCONNECTING_HEADERS; i++) {
+        CBlockHeader header;
+        header.hashPrevBlock = GetRandHash();
+        std::shared_ptr<const CSerializeData> msg = CreateMessage("headers", std::vector<CBlock>(1, CBlock(header)));
+        {
+            LOCK(dummyNode.cs_vRecvMsg);
+            BOOST_REQUIRE(dummyNode.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+            ProcessMessages(&dummyNode);
+        }
+
+        CSerializeData reply(CMessageHeader::HEADER_SIZE);
+        BOOST_REQUIRE_EQUAL(recv(fds[1], &reply[0], reply.size(), MSG_WAITALL), (ssize_t)reply.size());
+        CDataStream ss(reply.begin(), reply.end(), SER_NETWORK, PROTOCOL_VERSION);
+        CMessageHeader hdr(Params().MessageStart());
+        ss >> hdr;
+        BOOST_CHECK_EQUAL(hdr.GetCommand(), "getheaders");
+        reply.resize(hdr.nMessageSize);
+        BOOST_REQUIRE_EQUAL(recv(fds[1], &reply[0], reply.size(), MSG_WAITALL), (ssize_t)reply.size());
+
+        CNodeStateStats stats;
+        BOOST_REQUIRE(GetNodeStateStats(dummyNode.GetId(), stats));
+        BOOST_CHECK_EQUAL(stats.nMisbehavior, 20 * (i / MAX_UNCONNECTING_HEADERS));
+    }
+
+    close(fds[1]);
+}
+#endif
+
 CTransaction RandomOrphan()
 {
     std::map<uint256, COrphanTx>::iterator it;
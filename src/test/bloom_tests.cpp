@@ -534,4 +534,39 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(blocked_bloom)
+{
+    CBlockedBloomFilter filter(2000);
+    BOOST_CHECK_EQUAL(filter.size(), 0);
+    size_t nInitialUsage = filter.DynamicMemoryUsage();
+
+    // Fill to four times the initial size, which adds layers
+    std::vector<uint256> data;
+    for (int i = 0; i < 8000; i++) {
+        data.push_back(GetRandHash());
+        filter.insert(data.back());
+    }
+    BOOST_CHECK_EQUAL(filter.size(), 8000);
+    BOOST_CHECK(filter.DynamicMemoryUsage() > nInitialUsage);
+
+    // No false negatives
+    for (const uint256& hash : data) {
+        BOOST_CHECK(filter.contains(hash));
+    }
+
+    // Each full layer has a false positive rate of about 0.2%, so the two
+    // full layers should give about 40 hits when testing 10,000 random keys.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (filter.contains(GetRandHash()))
+            ++nHits;
+    }
+    BOOST_TEST_MESSAGE("BlockedBloomFilter got " << nHits << " false positives (~40 expected)");
+    BOOST_CHECK(nHits < 100);
+
+    filter.reset(100);
+    BOOST_CHECK_EQUAL(filter.size(), 0);
+    BOOST_CHECK(!filter.contains(data.back()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -13,6 +13,7 @@
 #include "undo.h"
 #include "primitives/transaction.h"
 #include "pubkey.h"
+#include "txdb.h"
 
 #include <vector>
 #include <map>
@@ -22,12 +23,20 @@
 
 namespace
 {
+bool operator==(const Coin &a, const Coin &b) {
+    // Empty Coin objects are always equal.
+    if (a.IsSpent() && b.IsSpent()) return true;
+    return a.fCoinBase == b.fCoinBase &&
+           a.nHeight == b.nHeight &&
+           a.out == b.out;
+}
+
 class CCoinsViewTest : public CCoinsView
 {
     uint256 hashBestBlock_;
     uint256 hashBestSproutAnchor_;
     uint256 hashBestSaplingAnchor_;
-    std::map<uint256, CCoins> map_;
+    std::map<COutPoint, Coin> map_;
     std::map<uint256, SproutMerkleTree> mapSproutAnchors_;
     std::map<uint256, SaplingMerkleTree> mapSaplingAnchors_;
     std::map<uint256, bool> mapSproutNullifiers_;
@@ -107,24 +116,24 @@ public:
         }
     }
 
-    bool GetCoins(const uint256& txid, CCoins& coins) const
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
     {
-        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        std::map<COutPoint, Coin>::const_iterator it = map_.find(outpoint);
         if (it == map_.end()) {
             return false;
         }
-        coins = it->second;
-        if (coins.IsPruned() && insecure_rand() % 2 == 0) {
+        coin = it->second;
+        if (coin.IsSpent() && insecure_rand() % 2 == 0) {
             // Randomly return false in case of an empty entry.
             return false;
         }
         return true;
     }
 
-    bool HaveCoins(const uint256& txid) const
+    bool HaveCoin(const COutPoint& outpoint) const
     {
-        CCoins coins;
-        return GetCoins(txid, coins);
+        Coin coin;
+        return GetCoin(outpoint, coin);
     }
 
     uint256 GetBestBlock() const { return hashBestBlock_; }
@@ -175,8 +184,8 @@ public:
         for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ) {
             if (it->second.flags & CCoinsCacheEntry::DIRTY) {
                 // Same optimization used in CCoinsViewDB is to only write dirty entries.
-                map_[it->first] = it->second.coins;
-                if (it->second.coins.IsPruned() && insecure_rand() % 3 == 0) {
+                map_[it->first] = it->second.coin;
+                if (it->second.coin.IsSpent() && insecure_rand() % 3 == 0) {
                     // Randomly delete empty entries on write.
                     map_.erase(it->first);
                 }
@@ -216,7 +225,7 @@ public:
                      memusage::DynamicUsage(cacheSproutNullifiers) +
                      memusage::DynamicUsage(cacheSaplingNullifiers);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coin.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
@@ -769,7 +778,7 @@ static const unsigned int NUM_SIMULATION_ITERATIONS = 40000;
 // This is a large randomized insert/remove simulation test on a variable-size
 // stack of caches on top of CCoinsViewTest.
 //
-// It will randomly create/update/delete CCoins entries to a tip of caches, with
+// It will randomly create/update/delete Coin entries to a tip of caches, with
 // txids picked from a limited list of random 256-bit hashes. Occasionally, a
 // new tip is added to the stack of caches, or the tip is flushed and removed.
 //
@@ -781,13 +790,14 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     bool removed_all_caches = false;
     bool reached_4_caches = false;
     bool added_an_entry = false;
+    bool added_an_unspendable_entry = false;
     bool removed_an_entry = false;
     bool updated_an_entry = false;
     bool found_an_entry = false;
     bool missed_an_entry = false;
 
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -805,36 +815,47 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
         // Do a random modification.
         {
             uint256 txid = txids[insecure_rand() % txids.size()]; // txid we're going to modify in this iteration.
-            CCoins& coins = result[txid];
-            CCoinsModifier entry = stack.back()->ModifyCoins(txid);
-            BOOST_CHECK(coins == *entry);
-            if (insecure_rand() % 5 == 0 || coins.IsPruned()) {
-                if (coins.IsPruned()) {
-                    added_an_entry = true;
+            Coin& coin = result[COutPoint(txid, 0)];
+            const Coin& entry = (insecure_rand() % 500 == 0) ? AccessByTxid(*stack.back(), txid) : stack.back()->AccessCoin(COutPoint(txid, 0));
+            BOOST_CHECK(coin == entry);
+            if (insecure_rand() % 5 == 0 || coin.IsSpent()) {
+                Coin newcoin;
+                newcoin.out.nValue = insecure_rand();
+                newcoin.nHeight = 1;
+                if (insecure_rand() % 16 == 0 && coin.IsSpent()) {
+                    newcoin.out.scriptPubKey.assign(1 + (insecure_rand() & 0x3F), OP_RETURN);
+                    BOOST_CHECK(newcoin.out.scriptPubKey.IsUnspendable());
+                    added_an_unspendable_entry = true;
                 } else {
-                    updated_an_entry = true;
+                    // Random sizes so we can test memory usage accounting
+                    newcoin.out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+                    if (coin.IsSpent()) {
+                        added_an_entry = true;
+                    } else {
+                        updated_an_entry = true;
+                    }
+                    coin = newcoin;
                 }
-                coins.nVersion = insecure_rand();
-                coins.vout.resize(1);
-                coins.vout[0].nValue = insecure_rand();
-                *entry = coins;
+                stack.back()->AddCoin(COutPoint(txid, 0), std::move(newcoin), !coin.IsSpent() || insecure_rand() % 2);
             } else {
-                coins.Clear();
-                entry->Clear();
+                coin.Clear();
+                stack.back()->SpendCoin(COutPoint(txid, 0));
                 removed_an_entry = true;
             }
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                    found_an_entry = true;
-                } else {
-                    BOOST_CHECK(it->second.IsPruned());
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
+                if (coin.IsSpent()) {
                     missed_an_entry = true;
+                } else {
+                    BOOST_CHECK(stack.back()->HaveCoinInCache(it->first));
+                    found_an_entry = true;
                 }
             }
             BOOST_FOREACH(const CCoinsViewCacheTest *test, stack) {
@@ -874,6 +895,7 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(removed_all_caches);
     BOOST_CHECK(reached_4_caches);
     BOOST_CHECK(added_an_entry);
+    BOOST_CHECK(added_an_unspendable_entry);
     BOOST_CHECK(removed_an_entry);
     BOOST_CHECK(updated_an_entry);
     BOOST_CHECK(found_an_entry);
@@ -930,7 +952,7 @@ BOOST_AUTO_TEST_CASE(coins_coinbase_spends)
 BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
 {
     // A simple map to track what we expect the cache stack to represent.
-    std::map<uint256, CCoins> result;
+    std::map<COutPoint, Coin> result;
 
     // The cache stack.
     CCoinsViewTest base; // A CCoinsViewTest at the bottom.
@@ -969,8 +991,7 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
                 tx.vin[0].prevout.n = 0;
 
                 // Update the expected result of prevouthash to know these coins are spent
-                CCoins& oldcoins = result[prevouthash];
-                oldcoins.Clear();
+                result[COutPoint(prevouthash, 0)].Clear();
 
                 alltxids.erase(prevouthash);
                 coinbaseids.erase(prevouthash);
@@ -981,21 +1002,18 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
             alltxids.insert(tx.GetHash());
 
             // Update the expected result to know about the new output coins
-            CCoins &coins = result[tx.GetHash()];
-            coins.FromTx(tx, height);
+            result[COutPoint(tx.GetHash(), 0)] = Coin(tx.vout[0], height, CTransaction(tx).IsCoinBase());
 
             UpdateCoins(tx, *(stack.back()), height);
         }
 
         // Once every 1000 iterations and at the end, verify the full cache.
         if (insecure_rand() % 1000 == 1 || i == NUM_SIMULATION_ITERATIONS - 1) {
-            for (std::map<uint256, CCoins>::iterator it = result.begin(); it != result.end(); it++) {
-                const CCoins* coins = stack.back()->AccessCoins(it->first);
-                if (coins) {
-                    BOOST_CHECK(*coins == it->second);
-                 } else {
-                    BOOST_CHECK(it->second.IsPruned());
-                 }
+            for (std::map<COutPoint, Coin>::iterator it = result.begin(); it != result.end(); it++) {
+                bool have = stack.back()->HaveCoin(it->first);
+                const Coin& coin = stack.back()->AccessCoin(it->first);
+                BOOST_CHECK(have == !coin.IsSpent());
+                BOOST_CHECK(coin == it->second);
             }
         }
 
@@ -1023,56 +1041,44 @@ BOOST_AUTO_TEST_CASE(updatecoins_simulation_test)
     }
 }
 
-BOOST_AUTO_TEST_CASE(ccoins_serialization)
+BOOST_AUTO_TEST_CASE(coin_serialization)
 {
     // Good example
-    CDataStream ss1(ParseHex("0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e"), SER_DISK, CLIENT_VERSION);
-    CCoins cc1;
+    CDataStream ss1(ParseHex("97f23c835800816115944e077fe7c803cfa57f29b36bf87c1d35"), SER_DISK, CLIENT_VERSION);
+    Coin cc1;
     ss1 >> cc1;
-    BOOST_CHECK_EQUAL(cc1.nVersion, 1);
     BOOST_CHECK_EQUAL(cc1.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc1.nHeight, 203998);
-    BOOST_CHECK_EQUAL(cc1.vout.size(), 2);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(0), false);
-    BOOST_CHECK_EQUAL(cc1.IsAvailable(1), true);
-    BOOST_CHECK_EQUAL(cc1.vout[1].nValue, 60000000000ULL);
-    BOOST_CHECK_EQUAL(HexStr(cc1.vout[1].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
+    BOOST_CHECK_EQUAL(cc1.out.nValue, 60000000000ULL);
+    BOOST_CHECK_EQUAL(HexStr(cc1.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("816115944e077fe7c803cfa57f29b36bf87c1d35"))))));
 
     // Good example
-    CDataStream ss2(ParseHex("0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b"), SER_DISK, CLIENT_VERSION);
-    CCoins cc2;
+    CDataStream ss2(ParseHex("8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4"), SER_DISK, CLIENT_VERSION);
+    Coin cc2;
     ss2 >> cc2;
-    BOOST_CHECK_EQUAL(cc2.nVersion, 1);
     BOOST_CHECK_EQUAL(cc2.fCoinBase, true);
     BOOST_CHECK_EQUAL(cc2.nHeight, 120891);
-    BOOST_CHECK_EQUAL(cc2.vout.size(), 17);
-    for (int i = 0; i < 17; i++) {
-        BOOST_CHECK_EQUAL(cc2.IsAvailable(i), i == 4 || i == 16);
-    }
-    BOOST_CHECK_EQUAL(cc2.vout[4].nValue, 234925952);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[4].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("61b01caab50f1b8e9c50a5057eb43c2d9563a4ee"))))));
-    BOOST_CHECK_EQUAL(cc2.vout[16].nValue, 110397);
-    BOOST_CHECK_EQUAL(HexStr(cc2.vout[16].scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
+    BOOST_CHECK_EQUAL(cc2.out.nValue, 110397);
+    BOOST_CHECK_EQUAL(HexStr(cc2.out.scriptPubKey), HexStr(GetScriptForDestination(CKeyID(uint160(ParseHex("8c988f1a4a4de2161e0f50aac7f17e7f9555caa4"))))));
 
-    // Smallest possible example
-    CDataStream ssx(SER_DISK, CLIENT_VERSION);
-    BOOST_CHECK_EQUAL(HexStr(ssx.begin(), ssx.end()), "");
+    // Round trip
+    CDataStream ss2out(SER_DISK, CLIENT_VERSION);
+    ss2out << cc2;
+    BOOST_CHECK_EQUAL(HexStr(ss2out.begin(), ss2out.end()), "8ddf77bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4");
 
-    CDataStream ss3(ParseHex("0002000600"), SER_DISK, CLIENT_VERSION);
-    CCoins cc3;
+    // Smallest possible example
+    CDataStream ss3(ParseHex("000006"), SER_DISK, CLIENT_VERSION);
+    Coin cc3;
     ss3 >> cc3;
-    BOOST_CHECK_EQUAL(cc3.nVersion, 0);
     BOOST_CHECK_EQUAL(cc3.fCoinBase, false);
     BOOST_CHECK_EQUAL(cc3.nHeight, 0);
-    BOOST_CHECK_EQUAL(cc3.vout.size(), 1);
-    BOOST_CHECK_EQUAL(cc3.IsAvailable(0), true);
-    BOOST_CHECK_EQUAL(cc3.vout[0].nValue, 0);
-    BOOST_CHECK_EQUAL(cc3.vout[0].scriptPubKey.size(), 0);
+    BOOST_CHECK_EQUAL(cc3.out.nValue, 0);
+    BOOST_CHECK_EQUAL(cc3.out.scriptPubKey.size(), 0);
 
     // scriptPubKey that ends beyond the end of the stream
-    CDataStream ss4(ParseHex("0002000800"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss4(ParseHex("000007"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc4;
+        Coin cc4;
         ss4 >> cc4;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
@@ -1083,13 +1089,251 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     uint64_t x = 3000000000ULL;
     tmp << VARINT(x);
     BOOST_CHECK_EQUAL(HexStr(tmp.begin(), tmp.end()), "8a95c0bb00");
-    CDataStream ss5(ParseHex("0002008a95c0bb0000"), SER_DISK, CLIENT_VERSION);
+    CDataStream ss5(ParseHex("00008a95c0bb00"), SER_DISK, CLIENT_VERSION);
     try {
-        CCoins cc5;
+        Coin cc5;
         ss5 >> cc5;
         BOOST_CHECK_MESSAGE(false, "We should have thrown");
     } catch (const std::ios_base::failure& e) {
     }
 }
 
+static void WriteCoinsToDB(CCoinsViewDB& db, const uint256& hashBlock, std::vector<COutPoint>& outpoints, int count)
+{
+    CCoinsViewCache cache(&db);
+    for (int i = 0; i < count; i++) {
+        COutPoint outpoint(GetRandHash(), i);
+        Coin coin;
+        coin.out.nValue = 1000 + i;
+        coin.out.scriptPubKey.assign(insecure_rand() % 64, 0);
+        coin.nHeight = 1;
+        cache.AddCoin(outpoint, std::move(coin), false);
+        outpoints.push_back(outpoint);
+    }
+    // Spend one of the coins written before, if any
+    if (outpoints.size() > (size_t)count) {
+        cache.SpendCoin(outpoints.front());
+    }
+    cache.SetBestBlock(hashBlock);
+    BOOST_CHECK(cache.Flush());
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_flush, TestingSetup)
+{
+    // Force a partial batch for nearly every entry
+    mapArgs["-dbbatchsize"] = "1";
+
+    CCoinsViewDB db(1 << 20, true);
+    std::vector<COutPoint> outpoints;
+    uint256 hashFirst = GetRandHash();
+    WriteCoinsToDB(db, hashFirst, outpoints, 100);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.GetBestBlock() == hashFirst);
+    for (const COutPoint& outpoint : outpoints) {
+        BOOST_CHECK(db.HaveCoin(outpoint));
+    }
+
+    // Changes handed to the background writer are visible right away
+    db.SetAsyncFlush(true);
+    uint256 hashSecond = GetRandHash();
+    WriteCoinsToDB(db, hashSecond, outpoints, 100);
+    BOOST_CHECK(db.GetBestBlock() == hashSecond);
+    BOOST_CHECK(!db.HaveCoin(outpoints.front()));
+    for (size_t i = 1; i < outpoints.size(); i++) {
+        BOOST_CHECK(db.HaveCoin(outpoints[i]));
+    }
+
+    // ... and remain so once they have been written
+    BOOST_CHECK(db.Sync());
+    BOOST_CHECK_EQUAL(db.PendingMemoryUsage(), 0);
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.GetBestBlock() == hashSecond);
+    BOOST_CHECK(!db.HaveCoin(outpoints.front()));
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(outpoints.back(), coin));
+    BOOST_CHECK_EQUAL(coin.out.nValue, 1000 + 99);
+
+    mapArgs.erase("-dbbatchsize");
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_flush_interrupted, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    SaplingMerkleTree tree;
+    tree.append(GetRandHash());
+    uint256 hashOld = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        cache.PushAnchor(tree);
+        cache.SetBestBlock(hashOld);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Disconnect the block that added the tree, in a flush that stops after
+    // its partial batches
+    mapArgs["-dbbatchsize"] = "1";
+    mapArgs["-dbsimulatecrash"] = "1";
+    TxWithNullifiers txWithNullifiers;
+    uint256 hashNew = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        cache.PopAnchor(SaplingMerkleTree::empty_root(), SAPLING);
+        cache.SetNullifiers(txWithNullifiers.tx, true);
+        cache.SetBestBlock(hashNew);
+        BOOST_CHECK(!cache.Flush());
+    }
+    mapArgs.erase("-dbsimulatecrash");
+    mapArgs.erase("-dbbatchsize");
+
+    // The database is marked as being between the two blocks, and the tree of
+    // the best anchor it still records is there for the replay
+    std::vector<uint256> heads = db.GetHeadBlocks();
+    BOOST_REQUIRE_EQUAL(heads.size(), 2);
+    BOOST_CHECK(heads[0] == hashNew);
+    BOOST_CHECK(heads[1] == hashOld);
+    BOOST_CHECK(db.GetBestAnchor(SAPLING) == tree.root());
+    SaplingMerkleTree result;
+    BOOST_CHECK(db.GetSaplingAnchorAt(tree.root(), result));
+    BOOST_CHECK(result == tree);
+
+    // Disconnecting the block again completes the flush
+    {
+        CCoinsViewCache cache(&db);
+        cache.PopAnchor(SaplingMerkleTree::empty_root(), SAPLING);
+        cache.SetNullifiers(txWithNullifiers.tx, true);
+        cache.SetBestBlock(hashNew);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetHeadBlocks().empty());
+    BOOST_CHECK(db.GetBestBlock() == hashNew);
+    BOOST_CHECK(db.GetBestAnchor(SAPLING) == SaplingMerkleTree::empty_root());
+    BOOST_CHECK(!db.GetSaplingAnchorAt(tree.root(), result));
+    BOOST_CHECK(db.GetNullifier(txWithNullifiers.saplingNullifier, SAPLING));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_nullifier_filter, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    TxWithNullifiers before;
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetNullifiers(before.tx, true);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Nullifiers already in the database are loaded into the filters
+    BOOST_CHECK(db.LoadNullifierFilters());
+    BOOST_CHECK(db.GetNullifier(before.sproutNullifier, SPROUT));
+    BOOST_CHECK(db.GetNullifier(before.saplingNullifier, SAPLING));
+
+    // ... and later ones are added as they are written
+    TxWithNullifiers after;
+    BOOST_CHECK(!db.GetNullifier(after.sproutNullifier, SPROUT));
+    BOOST_CHECK(!db.GetNullifier(after.saplingNullifier, SAPLING));
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetNullifiers(after.tx, true);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(db.GetNullifier(after.sproutNullifier, SPROUT));
+    BOOST_CHECK(db.GetNullifier(after.saplingNullifier, SAPLING));
+    BOOST_CHECK(!db.GetNullifier(after.sproutNullifier, SAPLING));
+
+    // Unspending a nullifier is not affected by it staying in the filter
+    {
+        CCoinsViewCache cache(&db);
+        cache.SetNullifiers(after.tx, false);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetNullifier(after.sproutNullifier, SPROUT));
+    BOOST_CHECK(!db.GetNullifier(after.saplingNullifier, SAPLING));
+}
+
+BOOST_AUTO_TEST_CASE(anchor_tree_cache)
+{
+    CAnchorTreeCache<SproutMerkleTree> cache(2);
+    SproutMerkleTree trees[3];
+    uint256 roots[3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j <= i; j++) {
+            trees[i].append(GetRandHash());
+        }
+        roots[i] = trees[i].root();
+    }
+
+    SproutMerkleTree tree;
+    BOOST_CHECK(!cache.Get(roots[0], tree));
+    cache.Put(roots[0], trees[0]);
+    cache.Put(roots[1], trees[1]);
+    BOOST_CHECK(cache.Get(roots[0], tree));
+    BOOST_CHECK(tree == trees[0]);
+
+    // roots[1] is now the least recently used, and is evicted first
+    cache.Put(roots[2], trees[2]);
+    BOOST_CHECK_EQUAL(cache.size(), 2);
+    BOOST_CHECK(!cache.Get(roots[1], tree));
+    BOOST_CHECK(cache.Get(roots[2], tree));
+    BOOST_CHECK(tree == trees[2]);
+    BOOST_CHECK(cache.DynamicMemoryUsage() > trees[0].DynamicMemoryUsage() + trees[2].DynamicMemoryUsage());
+
+    cache.Erase(roots[0]);
+    BOOST_CHECK(!cache.Get(roots[0], tree));
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_anchor_tree_cache, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    SaplingMerkleTree tree;
+    tree.append(GetRandHash());
+    uint256 rt = tree.root();
+    {
+        CCoinsViewCache cache(&db);
+        cache.PushAnchor(tree);
+        BOOST_CHECK(cache.Flush());
+    }
+
+    // Served from the tree cache, and from the database by a fresh view
+    SaplingMerkleTree result;
+    BOOST_CHECK(db.GetSaplingAnchorAt(rt, result));
+    BOOST_CHECK(result == tree);
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.GetSaplingAnchorAt(rt, result));
+        BOOST_CHECK(result == tree);
+    }
+
+    // A disconnect removes the anchor from the tree cache too
+    {
+        CCoinsViewCache cache(&db);
+        cache.PopAnchor(SaplingMerkleTree::empty_root(), SAPLING);
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.GetSaplingAnchorAt(rt, result));
+    BOOST_CHECK(db.GetBestAnchor(SAPLING) == SaplingMerkleTree::empty_root());
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_prefill, TestingSetup)
+{
+    CCoinsViewDB db(1 << 20, true);
+    std::vector<COutPoint> outpoints;
+    uint64_t nGeneration = db.GetWriteGeneration();
+    WriteCoinsToDB(db, GetRandHash(), outpoints, 2);
+    BOOST_CHECK(db.GetWriteGeneration() != nGeneration);
+
+    CCoinsViewCacheTest cache(&db);
+    Coin coin;
+    BOOST_CHECK(db.GetCoin(outpoints[0], coin));
+    BOOST_CHECK(cache.PrefillCoin(outpoints[0], std::move(coin)));
+    BOOST_CHECK(cache.HaveCoinInCache(outpoints[0]));
+    cache.SelfTest();
+
+    // An entry the cache already has, e.g. spent by an earlier block, is kept
+    cache.SpendCoin(outpoints[1]);
+    BOOST_CHECK(db.GetCoin(outpoints[1], coin));
+    BOOST_CHECK(!cache.PrefillCoin(outpoints[1], std::move(coin)));
+    BOOST_CHECK(!cache.HaveCoin(outpoints[1]));
+    cache.SelfTest();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
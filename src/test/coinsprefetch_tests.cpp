@@ -0,0 +1,94 @@
+// Copyright (c) 2019 The Zel Developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "chainparams.h"
+#include "coinsprefetch.h"
+#include "main.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "txdb.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(coinsprefetch_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(coinsprefetch_stale_results)
+{
+    const Consensus::Params& params = Params().GetConsensus();
+
+    // A coin in the database, and a block spending it
+    COutPoint prevout(GetRandHash(), 0);
+    pcoinsTip->AddCoin(prevout, Coin(CTxOut(1000, CScript() << OP_TRUE), 1, false), false);
+    pcoinsTip->Flush();
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    coinbase.vout.resize(1);
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = prevout;
+    spend.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(spend);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // Kept apart from the files of the test chain
+    CDiskBlockPos pos(1, 0);
+    BOOST_CHECK(WriteBlockToDisk(block, pos, Params().MessageStart()));
+    uint256 hash = block.GetHash();
+    CBlockIndex index(block);
+    index.phashBlock = &hash;
+    index.nHeight = 1;
+    index.nFile = pos.nFile;
+    index.nDataPos = pos.nPos;
+    index.nStatus = BLOCK_HAVE_DATA | BLOCK_VALID_TREE;
+
+    CCoinsPrefetcher prefetcher;
+
+    // Unchanged database: the coin is added to the cache
+    {
+        LOCK(cs_main);
+        prefetcher.Schedule(&index);
+    }
+    prefetcher.FetchNext(params);
+    {
+        CCoinsViewCache cache(pcoinsdbview);
+        BOOST_CHECK_EQUAL(prefetcher.Apply(&index, cache), 1);
+        BOOST_CHECK(cache.HaveCoinInCache(prevout));
+    }
+
+    // Written to while the block was queued: nothing is added
+    {
+        LOCK(cs_main);
+        prefetcher.Schedule(&index);
+    }
+    pcoinsTip->AddCoin(COutPoint(GetRandHash(), 0), Coin(CTxOut(1000, CScript() << OP_TRUE), 1, false), false);
+    pcoinsTip->Flush();
+    prefetcher.FetchNext(params);
+    {
+        CCoinsViewCache cache(pcoinsdbview);
+        BOOST_CHECK_EQUAL(prefetcher.Apply(&index, cache), 0);
+        BOOST_CHECK(!cache.HaveCoinInCache(prevout));
+    }
+
+    // Written to after the block was read: nothing is added either
+    {
+        LOCK(cs_main);
+        prefetcher.Schedule(&index);
+    }
+    prefetcher.FetchNext(params);
+    pcoinsTip->AddCoin(COutPoint(GetRandHash(), 0), Coin(CTxOut(1000, CScript() << OP_TRUE), 1, false), false);
+    pcoinsTip->Flush();
+    {
+        CCoinsViewCache cache(pcoinsdbview);
+        BOOST_CHECK_EQUAL(prefetcher.Apply(&index, cache), 0);
+        BOOST_CHECK(!cache.HaveCoinInCache(prevout));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
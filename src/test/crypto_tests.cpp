@@ -2,16 +2,21 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or https://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/blake2b.h"
+#include "crypto/common.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
 #include "crypto/sha512.h"
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
+#include "hash.h"
 #include "random.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
+#include "sodium.h"
+
 #include <vector>
 
 #include <boost/assign/list_of.hpp>
@@ -131,6 +136,22 @@ BOOST_AUTO_TEST_CASE(sha256_testvectors) {
     TestSHA256(test1, "a316d55510b49662420f49d145d42fb83f31ef8dc016aa4e32df049991a91e26");
 }
 
+BOOST_AUTO_TEST_CASE(sha256d64)
+{
+    for (int i = 0; i <= 32; ++i) {
+        unsigned char in[64 * 32];
+        unsigned char out1[32 * 32], out2[32 * 32];
+        for (int j = 0; j < 64 * i; ++j) {
+            in[j] = insecure_rand();
+        }
+        for (int j = 0; j < i; ++j) {
+            CHash256().Write(in + 64 * j, 64).Finalize(out1 + 32 * j);
+        }
+        SHA256D64(out2, in, i);
+        BOOST_CHECK(memcmp(out1, out2, 32 * i) == 0);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(sha512_testvectors) {
     TestSHA512("",
                "cf83e1357eefb8bdf1542850d66d8007d620e4050b5715dc83f4a921d36ce9ce"
@@ -248,4 +269,43 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+BOOST_AUTO_TEST_CASE(blake2b_leaf_hasher) {
+    // Compare against libsodium across prefix lengths around the block
+    // boundary, output lengths and batch sizes that leave partial lanes.
+    unsigned char personal[CBLAKE2bLeafHasher::PERSONAL_SIZE];
+    memcpy(personal, "ZcashPoW\xc8\x00\x00\x00\x09\x00\x00\x00", sizeof(personal));
+    const size_t prefixLens[] = {0, 1, 12, 124, 125, 128, 129, 140, 256, 300};
+    const size_t outLens[] = {1, 32, 50, 54, 64};
+    for (size_t prefixLen : prefixLens) {
+        std::vector<unsigned char> prefix(prefixLen);
+        for (size_t i = 0; i < prefixLen; i++) {
+            prefix[i] = insecure_rand();
+        }
+        for (size_t outLen : outLens) {
+            CBLAKE2bLeafHasher hasher(outLen, personal);
+            hasher.Write(prefix.data(), prefixLen / 2);
+            hasher.Write(prefix.data() + prefixLen / 2, prefixLen - prefixLen / 2);
+            for (size_t count = 1; count <= 9; count++) {
+                std::vector<uint32_t> indices(count);
+                for (size_t i = 0; i < count; i++) {
+                    indices[i] = insecure_rand();
+                }
+                std::vector<unsigned char> out(count * outLen);
+                hasher.Finalize(indices.data(), count, out.data());
+                for (size_t i = 0; i < count; i++) {
+                    crypto_generichash_blake2b_state state;
+                    crypto_generichash_blake2b_init_salt_personal(&state, NULL, 0, outLen, NULL, personal);
+                    crypto_generichash_blake2b_update(&state, prefix.data(), prefixLen);
+                    unsigned char le[4];
+                    WriteLE32(le, indices[i]);
+                    crypto_generichash_blake2b_update(&state, le, sizeof(le));
+                    std::vector<unsigned char> expected(outLen);
+                    crypto_generichash_blake2b_final(&state, expected.data(), outLen);
+                    BOOST_CHECK(std::equal(expected.begin(), expected.end(), out.begin() + i * outLen));
+                }
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
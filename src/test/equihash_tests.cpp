@@ -99,6 +99,13 @@ void TestEquihashValidator(unsigned int n, unsigned int k, const std::string &I,
     bool isValid;
     EhIsValidSolution(n, k, state, GetMinimalFromIndices(soln, cBitLen), isValid);
     BOOST_CHECK(isValid == expected);
+
+    // The batched leaf hashing path must agree with the libsodium one.
+    std::vector<unsigned char> input(I.begin(), I.end());
+    input.insert(input.end(), V.begin(), V.end());
+    bool isValidBatched;
+    EhIsValidSolutionForInput(n, k, input.data(), input.size(), GetMinimalFromIndices(soln, cBitLen), isValidBatched);
+    BOOST_CHECK(isValidBatched == expected);
 }
 
 #ifdef ENABLE_MINING
@@ -101,4 +101,17 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(block_download_quota)
+{
+    // Unknown rate
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(0), MAX_BLOCKS_IN_TRANSIT_PER_PEER);
+    // Enough blocks to keep the peer busy for BLOCK_DOWNLOAD_QUEUE_TIME
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(1000000LL * BLOCK_DOWNLOAD_QUEUE_TIME / 10), 10);
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(1000000LL * BLOCK_DOWNLOAD_QUEUE_TIME / 10 + 1), 10);
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(1000000LL * BLOCK_DOWNLOAD_QUEUE_TIME / 10 - 1), 11);
+    // Bounded for very slow and very fast peers
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(1000000LL * 60 * 60), MIN_BLOCKS_IN_TRANSIT_PER_PEER);
+    BOOST_CHECK_EQUAL(GetBlockDownloadQuota(1), MAX_ADAPTIVE_BLOCKS_IN_TRANSIT_PER_PEER);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
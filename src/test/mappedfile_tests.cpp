@@ -0,0 +1,87 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "mappedfile.h"
+#include "primitives/transaction.h"
+#include "streams.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <stdio.h>
+#include <string>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(mappedfile_tests, TestingSetup)
+
+#ifndef WIN32
+static void AppendToFile(const boost::filesystem::path& path, const std::string& str)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file);
+    BOOST_REQUIRE_EQUAL(fwrite(str.data(), 1, str.size(), file), str.size());
+    fclose(file);
+}
+
+BOOST_AUTO_TEST_CASE(mappedfile_cache)
+{
+    boost::filesystem::path pathA = pathTemp / "a.dat";
+    boost::filesystem::path pathB = pathTemp / "b.dat";
+    AppendToFile(pathA, "abcd");
+    AppendToFile(pathB, "efgh");
+
+    // Disabled until it is given a size
+    CMappedFileCache cache;
+    BOOST_CHECK(!cache.Get(pathA, 0));
+    cache.SetMaxFiles(1);
+
+    std::shared_ptr<const CMappedFile> fileA = cache.Get(pathA, 4);
+    BOOST_REQUIRE(fileA);
+    BOOST_CHECK_EQUAL(std::string(fileA->data(), fileA->size()), "abcd");
+    BOOST_CHECK(cache.Get(pathA, 4) == fileA);
+    BOOST_CHECK(!cache.Get(pathTemp / "missing.dat", 0));
+
+    // Appended data is picked up by mapping the file again
+    AppendToFile(pathA, "xyz");
+    std::shared_ptr<const CMappedFile> fileA2 = cache.Get(pathA, 7);
+    BOOST_REQUIRE(fileA2);
+    BOOST_CHECK(fileA2 != fileA);
+    BOOST_CHECK_EQUAL(std::string(fileA2->data(), fileA2->size()), "abcdxyz");
+    BOOST_CHECK(!cache.Get(pathA, 8));
+
+    // An evicted mapping stays readable for as long as it is used
+    std::shared_ptr<const CMappedFile> fileB = cache.Get(pathB, 4);
+    BOOST_REQUIRE(fileB);
+    BOOST_CHECK_EQUAL(cache.size(), 1);
+    BOOST_CHECK_EQUAL(std::string(fileA2->data(), fileA2->size()), "abcdxyz");
+
+    cache.Erase(pathB);
+    BOOST_CHECK_EQUAL(cache.size(), 0);
+    cache.SetMaxFiles(0);
+    BOOST_CHECK(!cache.Get(pathB, 0));
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CMutableTransaction mtx;
+    mtx.vout.resize(2);
+    mtx.vout[1].nValue = 42;
+    CTransaction tx(mtx);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << tx << (uint32_t)7;
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    CTransaction txRead;
+    reader >> txRead;
+    BOOST_CHECK(txRead.GetHash() == tx.GetHash());
+    BOOST_CHECK_EQUAL(reader.size(), 4);
+    reader.ignore(3);
+    uint32_t n;
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
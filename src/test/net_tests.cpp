@@ -0,0 +1,122 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+#include "streams.h"
+#include "uint256.h"
+#include "version.h"
+
+#include "test/test_bitcoin.h"
+
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(net_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(create_message)
+{
+    std::vector<unsigned char> payload(100, 0x42);
+    std::shared_ptr<const CSerializeData> msg = CreateMessage("tx", payload);
+    BOOST_REQUIRE(msg->size() > CMessageHeader::HEADER_SIZE);
+
+    CDataStream ss(msg->begin(), msg->end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), "tx");
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+
+    uint256 hash = Hash(ss.begin(), ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    BOOST_CHECK_EQUAL(hdr.nChecksum, nChecksum);
+
+    std::vector<unsigned char> payloadRead;
+    ss >> payloadRead;
+    BOOST_CHECK(payloadRead == payload);
+}
+
+BOOST_AUTO_TEST_CASE(inventory_known)
+{
+    CNode node(INVALID_SOCKET, CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+    CInv invKnown(MSG_TX, GetRandHash());
+    CInv invNew(MSG_TX, GetRandHash());
+
+    node.AddInventoryKnown(invKnown);
+    node.PushInventory(invKnown);
+    node.PushInventory(invNew);
+    BOOST_REQUIRE_EQUAL(node.vInventoryToSend.size(), 1);
+    BOOST_CHECK(node.vInventoryToSend[0].hash == invNew.hash);
+
+    // Only the most recent ones are remembered
+    for (unsigned int i = 0; i < 2 * INVENTORY_KNOWN_FILTER_SIZE; i++)
+        node.AddInventoryKnown(CInv(MSG_TX, GetRandHash()));
+    node.PushInventory(invKnown);
+    BOOST_CHECK_EQUAL(node.vInventoryToSend.size(), 2);
+}
+
+#ifndef WIN32
+static void QueueMessage(CNode& node, const std::shared_ptr<const CSerializeData>& msg)
+{
+    node.vSendMsg.push_back(msg);
+    node.nSendSize += msg->size();
+}
+
+BOOST_AUTO_TEST_CASE(send_queued_messages)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode node(fds[0], CAddress(CService("127.0.0.1", Params().GetDefaultPort())), "", true);
+
+    // Queued messages go out in one call, the shared one twice
+    std::shared_ptr<const CSerializeData> msgShared = CreateMessage("block", std::vector<unsigned char>(1000, 1));
+    std::shared_ptr<const CSerializeData> msgOther = CreateMessage("tx", std::vector<unsigned char>(10, 2));
+    CSerializeData expected;
+    {
+        LOCK(node.cs_vSend);
+        QueueMessage(node, msgShared);
+        QueueMessage(node, msgOther);
+        QueueMessage(node, msgShared);
+        expected.insert(expected.end(), msgShared->begin(), msgShared->end());
+        expected.insert(expected.end(), msgOther->begin(), msgOther->end());
+        expected.insert(expected.end(), msgShared->begin(), msgShared->end());
+        SocketSendData(&node);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0);
+        BOOST_CHECK_EQUAL(node.nSendCalls, 1);
+        BOOST_CHECK_EQUAL(node.nSendPartial, 0);
+    }
+    BOOST_CHECK_EQUAL(node.nSendBytes, expected.size());
+
+    CSerializeData received(expected.size());
+    BOOST_REQUIRE_EQUAL(recv(fds[1], &received[0], received.size(), MSG_WAITALL), (ssize_t)received.size());
+    BOOST_CHECK(received == expected);
+
+    // A message larger than the socket buffer is sent in parts
+    std::shared_ptr<const CSerializeData> msgLarge = CreateMessage("block", std::vector<unsigned char>(8 * 1024 * 1024, 3));
+    {
+        LOCK(node.cs_vSend);
+        QueueMessage(node, msgLarge);
+        SocketSendData(&node);
+        BOOST_CHECK_EQUAL(node.nSendPartial, 1);
+        BOOST_CHECK_EQUAL(node.vSendMsg.size(), 1);
+        BOOST_CHECK(node.nSendOffset > 0);
+        BOOST_CHECK_EQUAL(node.nSendSize, msgLarge->size());
+        BOOST_CHECK_EQUAL(node.nSendBytes, expected.size() + node.nSendOffset);
+    }
+
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,205 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/upgrades.h"
+#include "consensus/validation.h"
+#include "keystore.h"
+#include "main.h"
+#include "net.h"
+#include "random.h"
+#include "script/sign.h"
+#include "utiltime.h"
+
+#include "test/test_bitcoin.h"
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+/** Add a coin of key to the chainstate, and return a transaction spending it. */
+CTransaction SpendNewCoin(const CBasicKeyStore& keystore, const CKey& key)
+{
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    COutPoint prevout(GetRandHash(), 0);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = COIN - 10000;
+    tx.vout[0].scriptPubKey = scriptPubKey;
+
+    LOCK(cs_main);
+    pcoinsTip->AddCoin(prevout, Coin(CTxOut(COIN, scriptPubKey), 1, false), false);
+    uint32_t consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
+    BOOST_CHECK(SignSignature(keystore, scriptPubKey, tx, 0, COIN, SIGHASH_ALL, consensusBranchId));
+    return tx;
+}
+
+#ifndef WIN32
+/** Read the next message sent to the peer at fd, and return its command. */
+std::string ReadCommand(int fd)
+{
+    CSerializeData reply(CMessageHeader::HEADER_SIZE);
+    BOOST_REQUIRE_EQUAL(recv(fd, &reply[0], reply.size(), MSG_WAITALL), (ssize_t)reply.size());
+    CDataStream ss(reply.begin(), reply.end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    reply.resize(hdr.nMessageSize);
+    if (!reply.empty())
+        BOOST_REQUIRE_EQUAL(recv(fd, &reply[0], reply.size(), MSG_WAITALL), (ssize_t)reply.size());
+    return hdr.GetCommand();
+}
+#endif
+}
+
+BOOST_FIXTURE_TEST_SUITE(peertxcheck_tests, TestingSetup)
+
+BOOST_AUTO_TEST_CASE(peertxcheck_order)
+{
+    CNode node1(INVALID_SOCKET, CAddress(), "", true);
+    CNode node2(INVALID_SOCKET, CAddress(), "", true);
+    CMutableTransaction tx1, tx2, tx3;
+    tx1.nLockTime = 1;
+    tx2.nLockTime = 2;
+    tx3.nLockTime = 3;
+
+    CPeerTxCheckQueue queue;
+    queue.Push(&node1, tx1);
+    queue.Push(&node1, tx2);
+    queue.Push(&node2, tx3);
+    BOOST_CHECK_EQUAL(node1.nTxChecksPending, 2);
+    BOOST_CHECK_EQUAL(node2.nTxChecksPending, 1);
+
+    // The second transaction of node1 waits for its first one
+    CPeerTxCheckQueue::Entry entry1 = queue.Take();
+    BOOST_CHECK(entry1.pfrom == &node1 && entry1.tx == CTransaction(tx1));
+    CPeerTxCheckQueue::Entry entry2 = queue.Take();
+    BOOST_CHECK(entry2.pfrom == &node2 && entry2.tx == CTransaction(tx3));
+    queue.Finish(entry1);
+    BOOST_CHECK_EQUAL(node1.nTxChecksPending, 1);
+    CPeerTxCheckQueue::Entry entry3 = queue.Take();
+    BOOST_CHECK(entry3.pfrom == &node1 && entry3.tx == CTransaction(tx2));
+
+    queue.Finish(entry2);
+    queue.Finish(entry3);
+    BOOST_CHECK_EQUAL(node1.nTxChecksPending, 0);
+    BOOST_CHECK_EQUAL(node2.nTxChecksPending, 0);
+    BOOST_CHECK_EQUAL(node1.GetRefCount(), 0);
+    BOOST_CHECK_EQUAL(node2.GetRefCount(), 0);
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(peertxcheck_precheck_result)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode dummyNode(fds[0], CAddress(), "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+
+    uint32_t consensusBranchId;
+    {
+        LOCK(cs_main);
+        consensusBranchId = CurrentEpochBranchId(chainActive.Height() + 1, Params().GetConsensus());
+    }
+    CValidationState stateValid;
+    CValidationState stateInvalid;
+    stateInvalid.DoS(100, false, REJECT_INVALID, "bad-txns-sapling-proof-invalid");
+
+    // The checks a precheck ran are not repeated
+    CTransaction tx = SpendNewCoin(keystore, key);
+    BOOST_CHECK(PrecheckTransaction(tx, stateValid, Params(), consensusBranchId));
+    ProcessTransaction(&dummyNode, tx, &stateValid, consensusBranchId);
+    BOOST_CHECK(mempool.exists(tx.GetHash()));
+
+    // A failed precheck rejects the transaction, which would otherwise have
+    // been accepted, without checking it again
+    tx = SpendNewCoin(keystore, key);
+    ProcessTransaction(&dummyNode, tx, &stateInvalid, consensusBranchId);
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+    BOOST_CHECK_EQUAL(ReadCommand(fds[1]), "reject");
+    CNodeStateStats stats;
+    BOOST_REQUIRE(GetNodeStateStats(dummyNode.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 100);
+    // ... and it is not processed again
+    ProcessTransaction(&dummyNode, tx, NULL, 0);
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+
+    // Once the next block is on another consensus branch, the precheck is
+    // ignored and the transaction is checked in full
+    tx = SpendNewCoin(keystore, key);
+    ProcessTransaction(&dummyNode, tx, &stateInvalid, consensusBranchId + 1);
+    BOOST_CHECK(mempool.exists(tx.GetHash()));
+    BOOST_REQUIRE(GetNodeStateStats(dummyNode.GetId(), stats));
+    BOOST_CHECK_EQUAL(stats.nMisbehavior, 100);
+
+    mempool.clear();
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(peertxcheck_worker)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    CNode dummyNode(fds[0], CAddress(), "", true);
+    dummyNode.nVersion = PROTOCOL_VERSION;
+
+    CKey key;
+    key.MakeNewKey(true);
+    CBasicKeyStore keystore;
+    keystore.AddKey(key);
+    CTransaction tx = SpendNewCoin(keystore, key);
+    std::shared_ptr<const CSerializeData> msg = CreateMessage("tx", tx);
+
+    int nTxCheckThreadsOld = nTxCheckThreads;
+    nTxCheckThreads = 1;
+
+    // Messages of a peer with too many transactions waiting for a worker
+    // are held back
+    dummyNode.nTxChecksPending = MAX_PEER_TX_CHECKS_PENDING;
+    {
+        LOCK(dummyNode.cs_vRecvMsg);
+        BOOST_REQUIRE(dummyNode.ReceiveMsgBytes(&(*msg)[0], msg->size()));
+        ProcessMessages(&dummyNode);
+        BOOST_CHECK_EQUAL(dummyNode.vRecvMsg.size(), 1);
+    }
+    BOOST_CHECK_EQUAL(dummyNode.nTxChecksPending, MAX_PEER_TX_CHECKS_PENDING);
+
+    // ... and queued for a worker once it caught up
+    dummyNode.nTxChecksPending = 0;
+    {
+        LOCK(dummyNode.cs_vRecvMsg);
+        ProcessMessages(&dummyNode);
+        BOOST_CHECK(dummyNode.vRecvMsg.empty());
+    }
+    BOOST_CHECK_EQUAL(dummyNode.nTxChecksPending, 1);
+    BOOST_CHECK(!mempool.exists(tx.GetHash()));
+
+    boost::thread worker(&ThreadCheckPeerTransactions);
+    for (int i = 0; i < 1000 && dummyNode.nTxChecksPending > 0; i++)
+        MilliSleep(10);
+    worker.interrupt();
+    worker.join();
+    nTxCheckThreads = nTxCheckThreadsOld;
+
+    BOOST_CHECK_EQUAL(dummyNode.nTxChecksPending, 0);
+    BOOST_CHECK(mempool.exists(tx.GetHash()));
+    BOOST_CHECK_EQUAL(dummyNode.GetRefCount(), 0);
+
+    mempool.clear();
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,154 @@
+// Copyright (c) 2022 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "memusage.h"
+#include "random.h"
+#include "support/allocators/pool.h"
+
+#include "test/test_bitcoin.h"
+
+#include <cstring>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+#include <boost/unordered_map.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(pool_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(basic_allocating)
+{
+    PoolResource<8, 8> resource;
+    // no chunk is allocated until the pool is used
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0);
+
+    // first chunk is allocated on the first pooled allocation
+    void* block = resource.Allocate(8, 8);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1);
+
+    // a freed block is handed out again
+    resource.Deallocate(block, 8, 8);
+    void* b = resource.Allocate(8, 8);
+    BOOST_CHECK_EQUAL(b, block);
+
+    // a fresh block is carved from the same chunk
+    void* c = resource.Allocate(8, 8);
+    BOOST_CHECK(c != b);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1);
+
+    // zero bytes still takes a block
+    void* zero = resource.Allocate(0, 1);
+    BOOST_CHECK(zero != nullptr);
+    BOOST_CHECK(zero != b && zero != c);
+
+    // blocks that are too large or too strictly aligned bypass the pool
+    void* large = resource.Allocate(16, 8);
+    void* aligned = resource.Allocate(8, 16);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 1);
+    resource.Deallocate(large, 16, 8);
+    resource.Deallocate(aligned, 8, 16);
+
+    resource.Deallocate(zero, 0, 1);
+    resource.Deallocate(c, 8, 8);
+    resource.Deallocate(b, 8, 8);
+}
+
+BOOST_AUTO_TEST_CASE(chunk_rollover)
+{
+    // every chunk holds exactly four 16 byte blocks
+    PoolResource<16, 8> resource(64);
+    BOOST_CHECK_EQUAL(resource.ChunkSizeBytes(), 64);
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < 8; ++i) {
+        blocks.push_back(resource.Allocate(16, 8));
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 2);
+
+    // the leftover of a chunk is not wasted: it serves a smaller block
+    PoolResource<16, 8> leftover(24);
+    void* first = leftover.Allocate(16, 8);
+    void* second = leftover.Allocate(16, 8);
+    void* small = leftover.Allocate(8, 8);
+    BOOST_CHECK_EQUAL(leftover.NumAllocatedChunks(), 2);
+    BOOST_CHECK_EQUAL(static_cast<char*>(small), static_cast<char*>(first) + 16);
+    leftover.Deallocate(small, 8, 8);
+    leftover.Deallocate(second, 16, 8);
+    leftover.Deallocate(first, 16, 8);
+
+    for (void* block : blocks) {
+        resource.Deallocate(block, 16, 8);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(random_allocations)
+{
+    struct Allocation {
+        unsigned char* ptr;
+        size_t bytes;
+        unsigned char fill;
+    };
+
+    PoolResource<128, 8> resource(1024);
+    std::vector<Allocation> allocations;
+
+    for (int i = 0; i < 1000; ++i) {
+        // free a random allocation now and then, checking nobody wrote over it
+        if (!allocations.empty() && insecure_rand() % 3 == 0) {
+            size_t idx = insecure_rand() % allocations.size();
+            const Allocation& a = allocations[idx];
+            for (size_t j = 0; j < a.bytes; ++j) {
+                BOOST_CHECK_EQUAL(a.ptr[j], a.fill);
+            }
+            resource.Deallocate(a.ptr, a.bytes, 8);
+            allocations.erase(allocations.begin() + idx);
+        }
+
+        Allocation a;
+        a.bytes = insecure_rand() % 160;
+        a.fill = insecure_rand() & 0xff;
+        a.ptr = static_cast<unsigned char*>(resource.Allocate(a.bytes, 8));
+        BOOST_CHECK_EQUAL(reinterpret_cast<uintptr_t>(a.ptr) % 8, 0);
+        memset(a.ptr, a.fill, a.bytes);
+        allocations.push_back(a);
+    }
+
+    for (const Allocation& a : allocations) {
+        for (size_t j = 0; j < a.bytes; ++j) {
+            BOOST_CHECK_EQUAL(a.ptr[j], a.fill);
+        }
+        resource.Deallocate(a.ptr, a.bytes, 8);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(memusage_test)
+{
+    typedef PoolAllocator<std::pair<const int, int>, sizeof(std::pair<const int, int>) + 4 * sizeof(void*), alignof(void*)> Alloc;
+    typedef boost::unordered_map<int, int, boost::hash<int>, std::equal_to<int>, Alloc> Map;
+
+    Alloc::ResourceType resource;
+    Map map(0, Map::hasher(), Map::key_equal(), &resource);
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), 0);
+
+    for (int i = 0; i < 100000; ++i) {
+        map[i];
+    }
+    size_t chunks = resource.NumAllocatedChunks();
+    BOOST_CHECK(chunks > 0);
+
+    // the usage covers every chunk in full, plus the bucket array
+    size_t usage = memusage::DynamicUsage(map);
+    BOOST_CHECK(usage >= chunks * resource.ChunkSizeBytes());
+    BOOST_CHECK(usage >= memusage::MallocUsage(sizeof(void*) * map.bucket_count()));
+
+    // erased nodes are reused instead of allocating new chunks
+    for (int i = 0; i < 100000; ++i) {
+        map.erase(i);
+    }
+    for (int i = 0; i < 100000; ++i) {
+        map[i + 100000];
+    }
+    BOOST_CHECK_EQUAL(resource.NumAllocatedChunks(), chunks);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
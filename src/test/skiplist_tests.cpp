@@ -100,4 +100,27 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(findfork_test)
+{
+    std::vector<uint256> vHash(100);
+    std::vector<CBlockIndex> vBlocks(100);
+    for (unsigned int i=0; i<vBlocks.size(); i++) {
+        vHash[i] = ArithToUint256(i);
+        vBlocks[i].nHeight = i;
+        vBlocks[i].pprev = i ? &vBlocks[i - 1] : NULL;
+        vBlocks[i].phashBlock = &vHash[i];
+        vBlocks[i].BuildSkip();
+    }
+
+    // An empty chain, as when the genesis block is connected.
+    CChain chain;
+    BOOST_CHECK(chain.FindFork(NULL) == NULL);
+    BOOST_CHECK(chain.FindFork(&vBlocks[0]) == NULL);
+
+    chain.SetTip(&vBlocks[49]);
+    BOOST_CHECK(chain.FindFork(NULL) == NULL);
+    BOOST_CHECK(chain.FindFork(&vBlocks[20]) == &vBlocks[20]);
+    BOOST_CHECK(chain.FindFork(&vBlocks.back()) == &vBlocks[49]);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
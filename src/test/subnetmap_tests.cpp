@@ -0,0 +1,82 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "netbase.h"
+#include "subnetmap.h"
+
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(subnetmap_tests, BasicTestingSetup)
+
+static bool IsSet(int n) { return n > 0; }
+
+static bool AnyMatch(const CSubNetMap<int>& map, const std::string& strAddr)
+{
+    return map.AnyMatch(CNetAddr(strAddr), IsSet);
+}
+
+BOOST_AUTO_TEST_CASE(subnet_prefix_length)
+{
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4").GetPrefixLength(), 128);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/24").GetPrefixLength(), 120);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/0").GetPrefixLength(), 96);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/255.255.0.0").GetPrefixLength(), 112);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/255.0.255.0").GetPrefixLength(), -1);
+    BOOST_CHECK_EQUAL(CSubNet("1:2:3:4:5:6:7:8/32").GetPrefixLength(), 32);
+    BOOST_CHECK_EQUAL(CSubNet("::/0").GetPrefixLength(), 0);
+    BOOST_CHECK_EQUAL(CSubNet("1.2.3.4/33").GetPrefixLength(), -1);
+    BOOST_CHECK(CSubNet("1.2.3.4/24").GetNetwork() == CNetAddr("1.2.3.0"));
+}
+
+BOOST_AUTO_TEST_CASE(subnetmap_match)
+{
+    CSubNetMap<int> map;
+    BOOST_CHECK(!AnyMatch(map, "1.2.3.4"));
+
+    map[CSubNet("1.2.0.0/16")] = 1;
+    map[CSubNet("1.2.3.4")] = 1;
+    map[CSubNet("1:2:3:4::/64")] = 1;
+    map[CSubNet("10.0.0.0/255.0.0.255")] = 1;
+    BOOST_CHECK_EQUAL(map.size(), 4);
+
+    BOOST_CHECK(AnyMatch(map, "1.2.3.4"));
+    BOOST_CHECK(AnyMatch(map, "1.2.200.1"));
+    BOOST_CHECK(!AnyMatch(map, "1.3.0.0"));
+    BOOST_CHECK(AnyMatch(map, "1:2:3:4:5:6:7:8"));
+    BOOST_CHECK(!AnyMatch(map, "1:2:3:5::"));
+    BOOST_CHECK(AnyMatch(map, "10.1.2.0"));
+    BOOST_CHECK(!AnyMatch(map, "10.1.2.1"));
+
+    // Only values the predicate accepts count
+    map[CSubNet("1.2.0.0/16")] = 0;
+    BOOST_CHECK(AnyMatch(map, "1.2.3.4"));
+    BOOST_CHECK(!AnyMatch(map, "1.2.200.1"));
+
+    // Removing a subnet keeps the longer and shorter ones on its path
+    map[CSubNet("1.2.0.0/16")] = 1;
+    BOOST_CHECK_EQUAL(map.erase(CSubNet("1.2.3.4")), 1);
+    BOOST_CHECK_EQUAL(map.erase(CSubNet("1.2.3.4")), 0);
+    BOOST_CHECK(AnyMatch(map, "1.2.3.4"));
+    map[CSubNet("1.2.3.4")] = 1;
+    BOOST_CHECK_EQUAL(map.erase(CSubNet("1.2.0.0/16")), 1);
+    BOOST_CHECK(AnyMatch(map, "1.2.3.4"));
+    BOOST_CHECK(!AnyMatch(map, "1.2.3.5"));
+
+    BOOST_CHECK_EQUAL(map.erase(CSubNet("10.0.0.0/255.0.0.255")), 1);
+    BOOST_CHECK(!AnyMatch(map, "10.1.2.0"));
+
+    // Everything
+    map[CSubNet("::/0")] = 1;
+    map[CSubNet("0.0.0.0/0")] = 1;
+    BOOST_CHECK(AnyMatch(map, "1:2:3:5::"));
+    BOOST_CHECK(AnyMatch(map, "8.8.8.8"));
+
+    map.clear();
+    BOOST_CHECK(map.empty());
+    BOOST_CHECK(!AnyMatch(map, "1.2.3.4"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
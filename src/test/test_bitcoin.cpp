@@ -6,7 +6,9 @@
 
 #include "test_bitcoin.h"
 
+#include "crypto/blake2b.h"
 #include "crypto/common.h"
+#include "crypto/sha256.h"
 
 #include "key.h"
 #include "main.h"
@@ -71,6 +73,8 @@ JoinSplitTestingSetup::~JoinSplitTestingSetup()
 BasicTestingSetup::BasicTestingSetup()
 {
     assert(init_and_check_sodium() != -1);
+    SHA256AutoDetect();
+    BLAKE2bAutoDetect();
     ECC_Start();
     SetupEnvironment();
     SetupNetworking();
@@ -29,7 +29,6 @@ struct JoinSplitTestingSetup: public BasicTestingSetup {
  * and wallet (if enabled) setup.
  */
 struct TestingSetup: public JoinSplitTestingSetup {
-    CCoinsViewDB *pcoinsdbview;
     boost::filesystem::path orig_current_path;
     boost::filesystem::path pathTemp;
     boost::thread_group threadGroup;
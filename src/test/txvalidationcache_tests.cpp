@@ -0,0 +1,50 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "txvalidationcache.h"
+
+#include "script/interpreter.h"
+#include "test/test_bitcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(txvalidationcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(txvalidationcache_entries)
+{
+    CTxValidationCache cache;
+    uint256 txid = GetRandHash();
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    uint32_t branchId = 0x76b809bb;
+
+    uint256 entry = cache.ComputeEntry(txid, flags, branchId);
+    BOOST_CHECK(entry == cache.ComputeEntry(txid, flags, branchId));
+    BOOST_CHECK(!cache.Get(entry));
+
+    cache.Set(entry);
+    BOOST_CHECK(cache.Get(entry));
+    BOOST_CHECK_EQUAL(cache.Size(), 1);
+
+    // A different transaction, script flags or consensus branch must not hit
+    BOOST_CHECK(!cache.Get(cache.ComputeEntry(GetRandHash(), flags, branchId)));
+    BOOST_CHECK(!cache.Get(cache.ComputeEntry(txid, SCRIPT_VERIFY_P2SH, branchId)));
+    BOOST_CHECK(!cache.Get(cache.ComputeEntry(txid, flags, branchId + 1)));
+
+    cache.Erase(entry);
+    BOOST_CHECK(!cache.Get(entry));
+
+    cache.Set(entry);
+    cache.Clear();
+    BOOST_CHECK_EQUAL(cache.Size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(txvalidationcache_salted)
+{
+    // Entries are salted with a per-instance nonce
+    CTxValidationCache cache1, cache2;
+    uint256 txid = GetRandHash();
+    BOOST_CHECK(cache1.ComputeEntry(txid, SCRIPT_VERIFY_P2SH, 0) != cache2.ComputeEntry(txid, SCRIPT_VERIFY_P2SH, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
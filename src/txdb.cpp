@@ -7,10 +7,14 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
+#include "memusage.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
@@ -23,6 +27,7 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
@@ -34,6 +39,7 @@ static const char DB_BEST_SAPLING_ANCHOR = 'z';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_HEAD_BLOCKS = 'H';
 
 // insightexplorer
 static const char DB_ADDRESSINDEX = 'd';
@@ -42,13 +48,216 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_TIMESTAMPINDEX = 'T';
 static const char DB_BLOCKHASHINDEX = 'h';
 
-CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+/**
+ * Legacy class to deserialize pre-per-output database entries without reindex.
+ * It is a pruned version of CTransaction: it only retains metadata and unspent
+ * transaction outputs.
+ *
+ * Serialized format:
+ * - VARINT(nVersion)
+ * - VARINT(nCode)
+ * - unspentness bitvector, for vout[2] and further; least significant byte first
+ * - the non-spent CTxOuts (via CTxOutCompressor)
+ * - VARINT(nHeight)
+ *
+ * The nCode value consists of:
+ * - bit 1: IsCoinBase()
+ * - bit 2: vout[0] is not spent
+ * - bit 4: vout[1] is not spent
+ * - The higher bits encode N, the number of non-zero bytes in the following bitvector.
+ *   - In case both bit 2 and bit 4 are unset, they encode N-1, as there must be at
+ *     least one non-spent output).
+ *
+ * Example: 0104835800816115944e077fe7c803cfa57f29b36bf87c1d358bb85e
+ *          <><><--------------------------------------------><---->
+ *          |  \                  |                             /
+ *    version   code             vout[1]                  height
+ *
+ *    - version = 1
+ *    - code = 4 (vout[1] is not spent, and 0 non-zero bytes of bitvector follow)
+ *    - unspentness bitvector: as 0 non-zero bytes follow, it has length 0
+ *    - vout[1]: 835800816115944e077fe7c803cfa57f29b36bf87c1d35
+ *               * 8358: compact amount representation for 60000000000 (600 BTC)
+ *               * 00: special txout type pay-to-pubkey-hash
+ *               * 816115944e077fe7c803cfa57f29b36bf87c1d35: address uint160
+ *    - height = 203998
+ *
+ *
+ * Example: 0109044086ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4eebbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa486af3b
+ *          <><><--><--------------------------------------------------><----------------------------------------------><---->
+ *         /  \   \                     |                                                           |                     /
+ *  version  code  unspentness       vout[4]                                                     vout[16]           height
+ *
+ *  - version = 1
+ *  - code = 9 (coinbase, neither vout[0] or vout[1] are unspent,
+ *                2 (1, +1 because both bit 2 and bit 4 are unset) non-zero bitvector bytes follow)
+ *  - unspentness bitvector: bits 2 (0x04) and 14 (0x4000) are set, so vout[2+2] and vout[14+2] are unspent
+ *  - vout[4]: 86ef97d5790061b01caab50f1b8e9c50a5057eb43c2d9563a4ee
+ *             * 86ef97d579: compact amount representation for 234925952 (2.35 BTC)
+ *             * 00: special txout type pay-to-pubkey-hash
+ *             * 61b01caab50f1b8e9c50a5057eb43c2d9563a4ee: address uint160
+ *  - vout[16]: bbd123008c988f1a4a4de2161e0f50aac7f17e7f9555caa4
+ *              * bbd123: compact amount representation for 110397 (0.001 BTC)
+ *              * 00: special txout type pay-to-pubkey-hash
+ *              * 8c988f1a4a4de2161e0f50aac7f17e7f9555caa4: address uint160
+ *  - height = 120891
+ */
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Changes taken over by the background writer. They are served to readers
+ *  until they have been written, so the view never shows a half-written state. */
+struct CCoinsViewDB::PendingWrite
+{
+    CCoinsMapAllocator::ResourceType coinsResource;
+    CCoinsMap coins;
+    CAnchorsSproutMapAllocator::ResourceType sproutAnchorsResource;
+    CAnchorsSproutMap sproutAnchors;
+    CAnchorsSaplingMapAllocator::ResourceType saplingAnchorsResource;
+    CAnchorsSaplingMap saplingAnchors;
+    CNullifiersMapAllocator::ResourceType sproutNullifiersResource;
+    CNullifiersMap sproutNullifiers;
+    CNullifiersMapAllocator::ResourceType saplingNullifiersResource;
+    CNullifiersMap saplingNullifiers;
+
+    uint256 hashBlock;
+    uint256 hashSproutAnchor;
+    uint256 hashSaplingAnchor;
+
+    //! Memory used by the entries themselves, outside of the maps.
+    size_t innerUsage;
+
+    PendingWrite() :
+        coins(0, CCoinsMap::hasher(), CCoinsMap::key_equal(), &coinsResource),
+        sproutAnchors(0, CAnchorsSproutMap::hasher(), CAnchorsSproutMap::key_equal(), &sproutAnchorsResource),
+        saplingAnchors(0, CAnchorsSaplingMap::hasher(), CAnchorsSaplingMap::key_equal(), &saplingAnchorsResource),
+        sproutNullifiers(0, CNullifiersMap::hasher(), CNullifiersMap::key_equal(), &sproutNullifiersResource),
+        saplingNullifiers(0, CNullifiersMap::hasher(), CNullifiersMap::key_equal(), &saplingNullifiersResource),
+        innerUsage(0) {}
+
+    size_t DynamicMemoryUsage() const {
+        return memusage::DynamicUsage(coins) +
+               memusage::DynamicUsage(sproutAnchors) +
+               memusage::DynamicUsage(saplingAnchors) +
+               memusage::DynamicUsage(sproutNullifiers) +
+               memusage::DynamicUsage(saplingNullifiers) +
+               innerUsage;
+    }
+};
+
+static size_t EntryUsage(const CCoinsCacheEntry& entry) { return entry.coin.DynamicMemoryUsage(); }
+static size_t EntryUsage(const CAnchorsSproutCacheEntry& entry) { return entry.tree.DynamicMemoryUsage(); }
+static size_t EntryUsage(const CAnchorsSaplingCacheEntry& entry) { return entry.tree.DynamicMemoryUsage(); }
+static size_t EntryUsage(const CNullifiersCacheEntry& entry) { return 0; }
+
+/** Move the dirty entries of a cache map into the pending changes, and empty it. */
+template<typename Map>
+static void MoveDirtyEntries(Map& from, Map& to, size_t& usage)
+{
+    for (typename Map::iterator it = from.begin(); it != from.end(); ++it) {
+        if (it->second.flags & Map::mapped_type::DIRTY) {
+            usage += EntryUsage(it->second);
+            to.insert(std::make_pair(it->first, std::move(it->second)));
+        }
+    }
+    from.clear();
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) 
+/** Look a key up in the pending changes. Returns NULL if it is not there. */
+template<typename Map>
+static const typename Map::mapped_type* FindPending(const Map& map, const typename Map::key_type& key)
 {
+    typename Map::const_iterator it = map.find(key);
+    if (it == map.end())
+        return NULL;
+    return &it->second;
 }
 
+CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe), fAsyncFlush(false), fWriteFailed(false), nWriteGeneration(0), fNullifierFilters(false),
+    sproutTreeCache(ANCHOR_TREE_CACHE_SIZE), saplingTreeCache(ANCHOR_TREE_CACHE_SIZE) {
+}
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe), fAsyncFlush(false), fWriteFailed(false), nWriteGeneration(0), fNullifierFilters(false),
+    sproutTreeCache(ANCHOR_TREE_CACHE_SIZE), saplingTreeCache(ANCHOR_TREE_CACHE_SIZE)
+{
+}
+
+CCoinsViewDB::~CCoinsViewDB()
+{
+    if (writerThread.joinable())
+        writerThread.join();
+}
 
 bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
     if (rt == SproutMerkleTree::empty_root()) {
@@ -57,7 +266,20 @@ bool CCoinsViewDB::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree)
         return true;
     }
 
+    boost::unique_lock<boost::mutex> lock(csPending);
+    const CAnchorsSproutCacheEntry* entry = pending ? FindPending(pending->sproutAnchors, rt) : NULL;
+    if (entry) {
+        if (!entry->entered)
+            return false;
+        tree = entry->tree;
+        return true;
+    }
+    if (sproutTreeCache.Get(rt, tree))
+        return true;
+
     bool read = db.Read(make_pair(DB_SPROUT_ANCHOR, rt), tree);
+    if (read)
+        sproutTreeCache.Put(rt, tree);
 
     return read;
 }
@@ -69,7 +291,20 @@ bool CCoinsViewDB::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree
         return true;
     }
 
+    boost::unique_lock<boost::mutex> lock(csPending);
+    const CAnchorsSaplingCacheEntry* entry = pending ? FindPending(pending->saplingAnchors, rt) : NULL;
+    if (entry) {
+        if (!entry->entered)
+            return false;
+        tree = entry->tree;
+        return true;
+    }
+    if (saplingTreeCache.Get(rt, tree))
+        return true;
+
     bool read = db.Read(make_pair(DB_SAPLING_ANCHOR, rt), tree);
+    if (read)
+        saplingTreeCache.Put(rt, tree);
 
     return read;
 }
@@ -87,27 +322,72 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
         default:
             throw runtime_error("Unknown shielded type");
     }
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pending) {
+            const CNullifiersCacheEntry* entry = FindPending(type == SPROUT ? pending->sproutNullifiers : pending->saplingNullifiers, nf);
+            if (entry)
+                return entry->entered;
+        }
+        // Nearly all lookups are for nullifiers that were never spent.
+        if (fNullifierFilters && !(type == SPROUT ? sproutNullifierFilter : saplingNullifierFilter).contains(nf))
+            return false;
+    }
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        const CCoinsCacheEntry* entry = pending ? FindPending(pending->coins, outpoint) : NULL;
+        if (entry) {
+            if (entry->coin.IsSpent())
+                return false;
+            coin = entry->coin;
+            return true;
+        }
+    }
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        const CCoinsCacheEntry* entry = pending ? FindPending(pending->coins, outpoint) : NULL;
+        if (entry)
+            return !entry->coin.IsSpent();
+    }
+    return db.Exists(CoinEntry(&outpoint));
 }
 
-uint256 CCoinsViewDB::GetBestBlock() const {
+uint256 CCoinsViewDB::ReadBestBlock() const {
     uint256 hashBestChain;
     if (!db.Read(DB_BEST_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
 
+uint256 CCoinsViewDB::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pending && !pending->hashBlock.IsNull())
+            return pending->hashBlock;
+    }
+    return ReadBestBlock();
+}
+
 uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     uint256 hashBestAnchor;
-    
+
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pending) {
+            const uint256& hashPending = type == SPROUT ? pending->hashSproutAnchor : pending->hashSaplingAnchor;
+            if (!hashPending.IsNull())
+                return hashPending;
+        }
+    }
+
     switch (type) {
         case SPROUT:
             if (!db.Read(DB_BEST_SPROUT_ANCHOR, hashBestAnchor))
@@ -124,81 +404,340 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+std::vector<uint256> CCoinsViewDB::ReadHeadBlocks() const {
+    std::vector<uint256> vhashHeadBlocks;
+    if (!db.Read(DB_HEAD_BLOCKS, vhashHeadBlocks)) {
+        return std::vector<uint256>();
+    }
+    return vhashHeadBlocks;
+}
+
+std::vector<uint256> CCoinsViewDB::GetHeadBlocks() const {
+    {
+        // While the background writer runs, the database is consistent with
+        // the pending changes on top of it.
+        boost::unique_lock<boost::mutex> lock(csPending);
+        if (pending)
+            return std::vector<uint256>();
+    }
+    return ReadHeadBlocks();
+}
+
+/** Write the batch once it has grown beyond the configured size. Only used
+ *  while the database is marked as being between two blocks. */
+static bool WritePartialBatch(CDBWrapper& db, CDBBatch& batch, size_t nBatchSize, size_t& nPartialBatches)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
-        if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
-            if (!it->second.entered)
-                batch.Erase(make_pair(dbChar, it->first));
-            else
-                batch.Write(make_pair(dbChar, it->first), true);
-            // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
+    if (batch.SizeEstimate() <= nBatchSize)
+        return true;
+    LogPrint("coindb", "Writing partial batch of %.2f MiB\n", batch.SizeEstimate() * (1.0 / 1048576.0));
+    if (!db.WriteBatch(batch))
+        return false;
+    batch.Clear();
+    nPartialBatches++;
+    return true;
+}
+
+/** Write the new commitment trees. Anchors erased by a disconnect are left
+ *  to BatchEraseAnchors, as the best anchors still name them until the final
+ *  batch. */
+template<typename Map, typename Tree>
+static bool BatchWriteAnchors(CDBWrapper& db, CDBBatch& batch, const Map& mapToUse, const char& dbChar, size_t nBatchSize, size_t& nPartialBatches)
+{
+    for (typename Map::const_iterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
+        if ((it->second.flags & Map::mapped_type::DIRTY) && it->second.entered && it->first != Tree::empty_root()) {
+            batch.Write(make_pair(dbChar, it->first), it->second.tree);
+            if (!WritePartialBatch(db, batch, nBatchSize, nPartialBatches))
+                return false;
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapToUse.erase(itOld);
     }
+    return true;
 }
 
-template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+template<typename Map>
+static void BatchEraseAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
-        if (it->second.flags & MapEntry::DIRTY) {
+    for (typename Map::const_iterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
+        if ((it->second.flags & Map::mapped_type::DIRTY) && !it->second.entered)
+            batch.Erase(make_pair(dbChar, it->first));
+    }
+}
+
+static bool BatchWriteNullifiers(CDBWrapper& db, CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar, size_t nBatchSize, size_t& nPartialBatches)
+{
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
+        if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
-            else {
-                if (it->first != Tree::empty_root()) {
-                    batch.Write(make_pair(dbChar, it->first), it->second.tree);
-                }
-            }
-            // TODO: changed++?
+            else
+                batch.Write(make_pair(dbChar, it->first), true);
+            if (!WritePartialBatch(db, batch, nBatchSize, nPartialBatches))
+                return false;
         }
-        MapIterator itOld = it++;
-        mapToUse.erase(itOld);
     }
+    return true;
 }
 
-bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
-                              const uint256 &hashBlock,
-                              const uint256 &hashSproutAnchor,
-                              const uint256 &hashSaplingAnchor,
-                              CAnchorsSproutMap &mapSproutAnchors,
-                              CAnchorsSaplingMap &mapSaplingAnchors,
-                              CNullifiersMap &mapSproutNullifiers,
-                              CNullifiersMap &mapSaplingNullifiers) {
+bool CCoinsViewDB::WriteChanges(const CCoinsMap &mapCoins,
+                                const uint256 &hashBlock,
+                                const uint256 &hashSproutAnchor,
+                                const uint256 &hashSaplingAnchor,
+                                const CAnchorsSproutMap &mapSproutAnchors,
+                                const CAnchorsSaplingMap &mapSaplingAnchors,
+                                const CNullifiersMap &mapSproutNullifiers,
+                                const CNullifiersMap &mapSaplingNullifiers) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    size_t nPartialBatches = 0;
+    // Without a block to record, the changes cannot be marked as in progress
+    // and must be written atomically.
+    size_t nBatchSize = (size_t)GetArg("-dbbatchsize", nDefaultDbBatchSize);
+    if (hashBlock.IsNull())
+        nBatchSize = std::numeric_limits<size_t>::max();
+
+    if (!hashBlock.IsNull()) {
+        // A database that was not marked before is at its best block. One
+        // that still is marked was interrupted in the middle of a previous
+        // write, which these changes complete.
+        uint256 old_tip = ReadBestBlock();
+        if (old_tip.IsNull()) {
+            std::vector<uint256> old_heads = ReadHeadBlocks();
+            if (old_heads.size() == 2) {
+                assert(old_heads[0] == hashBlock);
+                old_tip = old_heads[1];
+            }
+        }
+
+        // Replace the best block by a marker that the database is moving from
+        // old_tip to hashBlock. A crash before the final batch leaves the
+        // marker, and the blocks in between are replayed on startup.
+        batch.Erase(DB_BEST_BLOCK);
+        batch.Write(DB_HEAD_BLOCKS, std::vector<uint256>{hashBlock, old_tip});
+    }
+
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
+            if (!WritePartialBatch(db, batch, nBatchSize, nPartialBatches))
+                return false;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    if (!::BatchWriteAnchors<CAnchorsSproutMap, SproutMerkleTree>(db, batch, mapSproutAnchors, DB_SPROUT_ANCHOR, nBatchSize, nPartialBatches) ||
+        !::BatchWriteAnchors<CAnchorsSaplingMap, SaplingMerkleTree>(db, batch, mapSaplingAnchors, DB_SAPLING_ANCHOR, nBatchSize, nPartialBatches) ||
+        !::BatchWriteNullifiers(db, batch, mapSproutNullifiers, DB_NULLIFIER, nBatchSize, nPartialBatches) ||
+        !::BatchWriteNullifiers(db, batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER, nBatchSize, nPartialBatches))
+        return false;
+
+    // After a crash before this batch, the blocks being disconnected are
+    // disconnected again on startup, which needs the trees of the best
+    // anchors still recorded. The erased anchors therefore go in the same
+    // batch as the new best anchors.
+    ::BatchEraseAnchors(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchEraseAnchors(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
 
-    ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
-    ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
+    if (nPartialBatches > 0 && GetBoolArg("-dbsimulatecrash", false)) {
+        LogPrintf("%s: Simulating a crash before the final batch\n", __func__);
+        return false;
+    }
 
-    if (!hashBlock.IsNull())
+    if (!hashBlock.IsNull()) {
+        batch.Erase(DB_HEAD_BLOCKS);
         batch.Write(DB_BEST_BLOCK, hashBlock);
+    }
     if (!hashSproutAnchor.IsNull())
         batch.Write(DB_BEST_SPROUT_ANCHOR, hashSproutAnchor);
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
+                              const uint256 &hashBlock,
+                              const uint256 &hashSproutAnchor,
+                              const uint256 &hashSaplingAnchor,
+                              CAnchorsSproutMap &mapSproutAnchors,
+                              CAnchorsSaplingMap &mapSaplingAnchors,
+                              CNullifiersMap &mapSproutNullifiers,
+                              CNullifiersMap &mapSaplingNullifiers) {
+    if (!fAsyncFlush) {
+        bool ret;
+        {
+            // Keep GetStats from taking its snapshot between partial batches.
+            boost::unique_lock<boost::mutex> lock(csPending);
+            nWriteGeneration++;
+            AddToNullifierFilters(mapSproutNullifiers, mapSaplingNullifiers);
+            UpdateAnchorTreeCaches(mapSproutAnchors, mapSaplingAnchors);
+            ret = WriteChanges(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor,
+                               mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers);
+        }
+        mapCoins.clear();
+        mapSproutAnchors.clear();
+        mapSaplingAnchors.clear();
+        mapSproutNullifiers.clear();
+        mapSaplingNullifiers.clear();
+        return ret;
+    }
+
+    // Only one set of changes is in flight at a time.
+    if (!Sync())
+        return false;
+    if (writerThread.joinable())
+        writerThread.join();
+
+    std::unique_ptr<PendingWrite> next(new PendingWrite());
+    size_t count = mapCoins.size();
+    ::MoveDirtyEntries(mapCoins, next->coins, next->innerUsage);
+    ::MoveDirtyEntries(mapSproutAnchors, next->sproutAnchors, next->innerUsage);
+    ::MoveDirtyEntries(mapSaplingAnchors, next->saplingAnchors, next->innerUsage);
+    ::MoveDirtyEntries(mapSproutNullifiers, next->sproutNullifiers, next->innerUsage);
+    ::MoveDirtyEntries(mapSaplingNullifiers, next->saplingNullifiers, next->innerUsage);
+    next->hashBlock = hashBlock;
+    next->hashSproutAnchor = hashSproutAnchor;
+    next->hashSaplingAnchor = hashSaplingAnchor;
+
+    LogPrint("coindb", "Handing %u changed transaction outputs (out of %u) to the background writer\n", (unsigned int)next->coins.size(), (unsigned int)count);
+    {
+        boost::unique_lock<boost::mutex> lock(csPending);
+        nWriteGeneration++;
+        AddToNullifierFilters(next->sproutNullifiers, next->saplingNullifiers);
+        UpdateAnchorTreeCaches(next->sproutAnchors, next->saplingAnchors);
+        pending = std::move(next);
+    }
+    writerThread = boost::thread(boost::bind(&CCoinsViewDB::ThreadWriteChanges, this));
+    return true;
+}
+
+void CCoinsViewDB::ThreadWriteChanges()
+{
+    RenameThread("zelcash-coinsflush");
+
+    // pending is only replaced after this thread has finished, so it can be
+    // read without holding csPending.
+    bool fWritten = false;
+    try {
+        fWritten = WriteChanges(pending->coins, pending->hashBlock, pending->hashSproutAnchor, pending->hashSaplingAnchor,
+                                pending->sproutAnchors, pending->saplingAnchors, pending->sproutNullifiers, pending->saplingNullifiers);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+
+    boost::unique_lock<boost::mutex> lock(csPending);
+    if (fWritten)
+        pending.reset();
+    else
+        fWriteFailed = true;
+    condPending.notify_all();
+}
+
+void CCoinsViewDB::SetAsyncFlush(bool fAsync)
+{
+    Sync();
+    fAsyncFlush = fAsync;
+}
+
+bool CCoinsViewDB::Sync() const
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    while (pending && !fWriteFailed)
+        condPending.wait(lock);
+    return !fWriteFailed;
+}
+
+size_t CCoinsViewDB::PendingMemoryUsage() const
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    return pending ? pending->DynamicMemoryUsage() : 0;
+}
+
+uint64_t CCoinsViewDB::GetWriteGeneration() const
+{
+    boost::unique_lock<boost::mutex> lock(csPending);
+    return nWriteGeneration;
+}
+
+void CCoinsViewDB::AddToNullifierFilters(const CNullifiersMap &mapSproutNullifiers, const CNullifiersMap &mapSaplingNullifiers)
+{
+    // Nullifiers must be in the filters before they can be read from the database.
+    if (!fNullifierFilters)
+        return;
+    for (CNullifiersMap::const_iterator it = mapSproutNullifiers.begin(); it != mapSproutNullifiers.end(); ++it) {
+        if ((it->second.flags & CNullifiersCacheEntry::DIRTY) && it->second.entered)
+            sproutNullifierFilter.insert(it->first);
+    }
+    for (CNullifiersMap::const_iterator it = mapSaplingNullifiers.begin(); it != mapSaplingNullifiers.end(); ++it) {
+        if ((it->second.flags & CNullifiersCacheEntry::DIRTY) && it->second.entered)
+            saplingNullifierFilter.insert(it->first);
+    }
+}
+
+template<typename Map, typename Tree>
+static void UpdateAnchorTreeCache(CAnchorTreeCache<Tree>& cache, const Map& mapAnchors)
+{
+    for (typename Map::const_iterator it = mapAnchors.begin(); it != mapAnchors.end(); ++it) {
+        if (!(it->second.flags & Map::mapped_type::DIRTY))
+            continue;
+        // The trees just written are the ones the next blocks and
+        // transactions will ask for.
+        if (it->second.entered)
+            cache.Put(it->first, it->second.tree);
+        else
+            cache.Erase(it->first);
+    }
+}
+
+void CCoinsViewDB::UpdateAnchorTreeCaches(const CAnchorsSproutMap &mapSproutAnchors, const CAnchorsSaplingMap &mapSaplingAnchors)
+{
+    ::UpdateAnchorTreeCache(sproutTreeCache, mapSproutAnchors);
+    ::UpdateAnchorTreeCache(saplingTreeCache, mapSaplingAnchors);
+}
+
+/** Call fn for the key of every nullifier stored under dbChar. */
+template<typename Callable>
+static void ForEachNullifier(CDBWrapper& db, char dbChar, Callable fn)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(dbChar, uint256()));
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, uint256> key;
+        if (!pcursor->GetKey(key) || key.first != dbChar)
+            break;
+        fn(key.second);
+        pcursor->Next();
+    }
+}
+
+bool CCoinsViewDB::LoadNullifierFilters()
+{
+    if (!Sync())
+        return false;
+    boost::unique_lock<boost::mutex> lock(csPending);
+
+    // Count first, so the filters are sized for the current sets with room to grow.
+    size_t nSprout = 0, nSapling = 0;
+    ForEachNullifier(db, DB_NULLIFIER, [&nSprout](const uint256&) { nSprout++; });
+    ForEachNullifier(db, DB_SAPLING_NULLIFIER, [&nSapling](const uint256&) { nSapling++; });
+
+    sproutNullifierFilter.reset(nSprout * 2);
+    saplingNullifierFilter.reset(nSapling * 2);
+    ForEachNullifier(db, DB_NULLIFIER, [this](const uint256& nf) { sproutNullifierFilter.insert(nf); });
+    ForEachNullifier(db, DB_SAPLING_NULLIFIER, [this](const uint256& nf) { saplingNullifierFilter.insert(nf); });
+    fNullifierFilters = true;
+
+    LogPrintf("Loaded %u Sprout and %u Sapling nullifiers into filters (%.1f MiB)\n", (unsigned int)nSprout, (unsigned int)nSapling,
+              (sproutNullifierFilter.DynamicMemoryUsage() + saplingNullifierFilter.DynamicMemoryUsage()) * (1.0 / (1 << 20)));
+    return true;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -222,35 +761,59 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+/** Fold the unspent outputs of one transaction into the UTXO set statistics.
+ *  The hashed data is the same as for the per-transaction records of older
+ *  versions, so hashSerialized is unaffected by the database upgrade. */
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        const CTxOut &out = it->second.out;
+        stats.nTransactionOutputs++;
+        ss << VARINT(it->first + 1);
+        ss << out;
+        stats.nTotalAmount += out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    boost::scoped_ptr<CDBIterator> pcursor;
+    {
+        // The iterator reads a snapshot, which must not be taken while
+        // changes are being written in several batches.
+        boost::unique_lock<boost::mutex> lock(csPending);
+        while (pending && !fWriteFailed)
+            condPending.wait(lock);
+        if (fWriteFailed)
+            return error("CCoinsViewDB::GetStats() : writing the coin database failed");
+        pcursor.reset(const_cast<CDBWrapper*>(&db)->NewIterator());
+        stats.hashBlock = ReadBestBlock();
+    }
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint key;
+        CoinEntry entry(&key);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (!outputs.empty() && key.hash != prevkey) {
+                    ApplyStats(stats, ss, outputs);
+                    outputs.clear();
                 }
+                prevkey = key.hash;
+                outputs[key.n] = std::move(coin);
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -259,15 +822,86 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-transaction records of older versions to
+ * per-output records.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    if (!pcursor->Valid()) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<char, uint256> key;
+    std::pair<char, uint256> prev_key = make_pair(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(make_pair(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<std::pair<int, const CBlockFileInfo*> >::const_iterator it=fileInfo.begin(); it != fileInfo.end(); it++) {
@@ -280,6 +914,10 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadDiskBlockIndex(const uint256 &blockhash, CDiskBlockIndex &dbindex) {
+    return Read(make_pair(DB_BLOCK_INDEX, blockhash), dbindex);
+}
+
 bool CBlockTreeDB::EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo) {
     CDBBatch batch(*this);
     for (std::vector<const CBlockIndex*>::const_iterator it=blockinfo.begin(); it != blockinfo.end(); it++) {
@@ -456,56 +1094,177 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+/**
+ * Hands out the block index entries deserialized and checked by the loader
+ * threads to the thread that inserts them into mapBlockIndex, in chunks, with
+ * a bound on the number of chunks in flight to cap memory use.
+ */
+class CBlockIndexLoadQueue
+{
+public:
+    typedef std::vector<std::pair<uint256, CDiskBlockIndex> > chunk_type;
+
+private:
+    boost::mutex mutex;
+    boost::condition_variable condProducer;
+    boost::condition_variable condConsumer;
+    std::deque<chunk_type> queue;
+    int nProducers;
+    bool fFailed;
+
+public:
+    CBlockIndexLoadQueue(int nProducersIn) : nProducers(nProducersIn), fFailed(false) {}
+
+    //! Returns false if loading has failed and the producer should stop.
+    bool Push(chunk_type& chunk)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.size() >= BLOCK_INDEX_LOAD_MAX_CHUNKS && !fFailed)
+            condProducer.wait(lock);
+        if (fFailed)
+            return false;
+        queue.push_back(chunk_type());
+        queue.back().swap(chunk);
+        condConsumer.notify_one();
+        return true;
+    }
+
+    //! Returns false once all producers are done and the queue is drained.
+    bool Pop(chunk_type& chunk)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty() && nProducers > 0)
+            condConsumer.wait(lock);
+        if (queue.empty())
+            return false;
+        chunk.swap(queue.front());
+        queue.pop_front();
+        condProducer.notify_one();
+        return true;
+    }
+
+    void ProducerDone(bool fSuccess)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nProducers--;
+        if (!fSuccess)
+            fFailed = true;
+        condConsumer.notify_all();
+        condProducer.notify_all();
+    }
+
+    void Abort()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        fFailed = true;
+        condProducer.notify_all();
+    }
+
+    bool Failed()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return fFailed;
+    }
+};
+
+bool CBlockTreeDB::LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, CBlockIndexLoadQueue& loadQueue)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
-    pcursor->Seek(make_pair(DB_BLOCK_INDEX, uint256()));
+    uint256 hashBegin;
+    *hashBegin.begin() = nBegin;
+    pcursor->Seek(make_pair(DB_BLOCK_INDEX, hashBegin));
 
-    // Load mapBlockIndex
+    CBlockIndexLoadQueue::chunk_type chunk;
+    chunk.reserve(BLOCK_INDEX_LOAD_CHUNK_SIZE);
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
         std::pair<char, uint256> key;
-        if (pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX) {
-            CDiskBlockIndex diskindex;
-            if (pcursor->GetValue(diskindex)) {
-                // Construct block index object
-                CBlockIndex* pindexNew = insertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nSolution      = diskindex.nSolution;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
-                pindexNew->nTx            = diskindex.nTx;
-                pindexNew->nSproutValue   = diskindex.nSproutValue;
-                pindexNew->nSaplingValue  = diskindex.nSaplingValue;
-
-                // Consistency checks
-                auto header = pindexNew->GetBlockHeader();
-                if (header.GetHash() != pindexNew->GetBlockHash())
-                    return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, in-memory = %s",
-                       diskindex.ToString(),  pindexNew->ToString());
-                if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits, Params().GetConsensus()))
-                    return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
-
-                pcursor->Next();
-            } else {
-                return error("LoadBlockIndex() : failed to read value");
-            }
-        } else {
+        if (!(pcursor->GetKey(key) && key.first == DB_BLOCK_INDEX && *key.second.begin() < nEnd))
             break;
+
+        CDiskBlockIndex diskindex;
+        if (!pcursor->GetValue(diskindex))
+            return error("LoadBlockIndex() : failed to read value");
+
+        // Consistency checks
+        uint256 hash = diskindex.GetBlockHash();
+        if (hash != key.second)
+            return error("LoadBlockIndex(): block header inconsistency detected: on-disk = %s, key = %s",
+                diskindex.ToString(), key.second.ToString());
+        if (!CheckProofOfWork(hash, diskindex.nBits, Params().GetConsensus()))
+            return error("LoadBlockIndex(): CheckProofOfWork failed: %s", diskindex.ToString());
+
+        // The solution is in the database, no need to keep it in memory
+        diskindex.TrimSolution();
+        chunk.push_back(std::make_pair(hash, std::move(diskindex)));
+
+        if (chunk.size() >= BLOCK_INDEX_LOAD_CHUNK_SIZE) {
+            if (!loadQueue.Push(chunk))
+                return false;
+            chunk.reserve(BLOCK_INDEX_LOAD_CHUNK_SIZE);
         }
+        pcursor->Next();
     }
 
-    return true;
+    return chunk.empty() || loadQueue.Push(chunk);
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex)
+{
+    // Entries are keyed by block hash, so they are spread evenly over the key
+    // space. Split it into ranges on the first byte of the hash, deserialize
+    // and check each range on its own thread, and insert the results into
+    // mapBlockIndex from this thread as they come in.
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_BLOCK_INDEX_LOAD_THREADS));
+    CBlockIndexLoadQueue loadQueue(nThreads);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads; i++) {
+        unsigned int nBegin = 256 * i / nThreads;
+        unsigned int nEnd = 256 * (i + 1) / nThreads;
+        threadGroup.create_thread([this, nBegin, nEnd, &loadQueue] {
+            RenameThread("zelcash-loadblk");
+            loadQueue.ProducerDone(LoadBlockIndexRange(nBegin, nEnd, loadQueue));
+        });
+    }
+
+    bool fInterrupted = false;
+    CBlockIndexLoadQueue::chunk_type chunk;
+    while (loadQueue.Pop(chunk)) {
+        if (!fInterrupted && boost::this_thread::interruption_requested()) {
+            fInterrupted = true;
+            loadQueue.Abort();
+        }
+        if (fInterrupted)
+            continue;
+
+        for (const auto& entry : chunk) {
+            const CDiskBlockIndex& diskindex = entry.second;
+
+            // Construct block index object
+            CBlockIndex* pindexNew = insertBlockIndex(entry.first);
+            pindexNew->pprev          = insertBlockIndex(diskindex.hashPrev);
+            pindexNew->nHeight        = diskindex.nHeight;
+            pindexNew->nFile          = diskindex.nFile;
+            pindexNew->nDataPos       = diskindex.nDataPos;
+            pindexNew->nUndoPos       = diskindex.nUndoPos;
+            pindexNew->hashSproutAnchor     = diskindex.hashSproutAnchor;
+            pindexNew->nVersion       = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashFinalSaplingRoot   = diskindex.hashFinalSaplingRoot;
+            pindexNew->nTime          = diskindex.nTime;
+            pindexNew->nBits          = diskindex.nBits;
+            pindexNew->nNonce         = diskindex.nNonce;
+            pindexNew->nStatus        = diskindex.nStatus;
+            pindexNew->nCachedBranchId = diskindex.nCachedBranchId;
+            pindexNew->nTx            = diskindex.nTx;
+            pindexNew->nSproutValue   = diskindex.nSproutValue;
+            pindexNew->nSaplingValue  = diskindex.nSaplingValue;
+        }
+    }
+    threadGroup.join_all();
+
+    if (fInterrupted)
+        throw boost::thread_interrupted();
+
+    return !loadQueue.Failed();
 }
@@ -8,16 +8,23 @@
 
 #include "coins.h"
 #include "dbwrapper.h"
+#include "bloom.h"
 #include "chain.h"
 
 #include <map>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 class CBlockIndex;
+class CBlockIndexLoadQueue;
+class CDiskBlockIndex;
 
 // START insightexplorer
 struct CAddressUnspentKey;
@@ -45,6 +52,18 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -dbbatchsize default (bytes)
+static const int64_t nDefaultDbBatchSize = 16 << 20;
+//! -dbflushthread default
+static const bool DEFAULT_DB_FLUSH_THREAD = false;
+//! Number of recently used commitment trees per shielded type kept deserialized in memory
+static const size_t ANCHOR_TREE_CACHE_SIZE = 128;
+//! max. number of threads deserializing the block index at startup
+static const int MAX_BLOCK_INDEX_LOAD_THREADS = 8;
+//! number of block index entries handed over at once by a loading thread
+static const size_t BLOCK_INDEX_LOAD_CHUNK_SIZE = 4096;
+//! max. number of loaded chunks waiting to be inserted into the block index
+static const size_t BLOCK_INDEX_LOAD_MAX_CHUNKS = 16;
 
 struct CDiskTxPos : public CDiskBlockPos
 {
@@ -71,7 +90,17 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/** CCoinsView backed by the coin database (chainstate/)
+ *
+ * Large flushes are written in batches of at most -dbbatchsize bytes. While
+ * that happens the database is marked as moving between two blocks (see
+ * GetHeadBlocks), so that a flush interrupted by a crash can be completed by
+ * replaying blocks at the next startup.
+ *
+ * With SetAsyncFlush(true), BatchWrite only takes over the changes and a
+ * background thread writes them. Until that has finished, the changes are
+ * served from memory, so readers never see a partially written state.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
@@ -79,14 +108,16 @@ protected:
     CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
+    std::vector<uint256> GetHeadBlocks() const;
     bool BatchWrite(CCoinsMap &mapCoins,
                     const uint256 &hashBlock,
                     const uint256 &hashSproutAnchor,
@@ -96,6 +127,69 @@ public:
                     CNullifiersMap &mapSproutNullifiers,
                     CNullifiersMap &mapSaplingNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Convert per-transaction records of an older database format into per-output records.
+    //! Returns false if the conversion failed or was interrupted by a shutdown request.
+    bool Upgrade();
+
+    //! Write flushed changes from a background thread instead of inside BatchWrite.
+    void SetAsyncFlush(bool fAsync);
+    bool IsAsyncFlush() const { return fAsyncFlush; }
+
+    //! Wait until the background thread has written all changes handed to it.
+    //! Returns false if writing them failed.
+    bool Sync() const;
+
+    //! Memory held by changes that have not been written by the background thread yet.
+    size_t PendingMemoryUsage() const;
+
+    //! Incremented by every BatchWrite. Values read before and after a set of
+    //! lookups are equal only if the view did not change in between.
+    uint64_t GetWriteGeneration() const;
+
+    //! Build the filters that let GetNullifier skip the database for nullifiers
+    //! that were never spent. Until this is called, every lookup reads the database.
+    bool LoadNullifierFilters();
+
+private:
+    struct PendingWrite;
+
+    bool fAsyncFlush;
+
+    //! Guards pending and fWriteFailed; signalled when the background thread finishes.
+    mutable boost::mutex csPending;
+    mutable boost::condition_variable condPending;
+    std::unique_ptr<PendingWrite> pending;
+    bool fWriteFailed;
+    boost::thread writerThread;
+    uint64_t nWriteGeneration;
+
+    //! Every spent nullifier in the database is in these filters (guarded by csPending).
+    //! Nullifiers erased on disconnect are left in, which only costs a database read.
+    bool fNullifierFilters;
+    CBlockedBloomFilter sproutNullifierFilter;
+    CBlockedBloomFilter saplingNullifierFilter;
+
+    void AddToNullifierFilters(const CNullifiersMap &mapSproutNullifiers, const CNullifiersMap &mapSaplingNullifiers);
+
+    //! Recently used and written commitment trees (guarded by csPending). Anchors
+    //! erased by a disconnect are dropped from them.
+    mutable CAnchorTreeCache<SproutMerkleTree> sproutTreeCache;
+    mutable CAnchorTreeCache<SaplingMerkleTree> saplingTreeCache;
+
+    void UpdateAnchorTreeCaches(const CAnchorsSproutMap &mapSproutAnchors, const CAnchorsSaplingMap &mapSaplingAnchors);
+
+    uint256 ReadBestBlock() const;
+    std::vector<uint256> ReadHeadBlocks() const;
+    bool WriteChanges(const CCoinsMap &mapCoins,
+                      const uint256 &hashBlock,
+                      const uint256 &hashSproutAnchor,
+                      const uint256 &hashSaplingAnchor,
+                      const CAnchorsSproutMap &mapSproutAnchors,
+                      const CAnchorsSaplingMap &mapSaplingAnchors,
+                      const CNullifiersMap &mapSproutNullifiers,
+                      const CNullifiersMap &mapSaplingNullifiers);
+    void ThreadWriteChanges();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -109,6 +203,7 @@ private:
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool EraseBatchSync(const std::vector<const CBlockIndex*>& blockinfo);
+    bool ReadDiskBlockIndex(const uint256 &blockhash, CDiskBlockIndex &dbindex);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo &fileinfo);
     bool ReadLastBlockFile(int &nFile);
     bool WriteReindexing(bool fReindex);
@@ -135,6 +230,8 @@ public:
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+private:
+    bool LoadBlockIndexRange(unsigned int nBegin, unsigned int nEnd, CBlockIndexLoadQueue& loadQueue);
 };
 
 #endif // BITCOIN_TXDB_H
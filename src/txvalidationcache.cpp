@@ -0,0 +1,71 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#include "txvalidationcache.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "memusage.h"
+#include "random.h"
+#include "util.h"
+
+CTxValidationCache txValidationCache;
+
+CTxValidationCache::CTxValidationCache()
+{
+    GetRandBytes(nonce.begin(), 32);
+}
+
+uint256 CTxValidationCache::ComputeEntry(const uint256& txid, unsigned int flags, uint32_t consensusBranchId) const
+{
+    unsigned char buf[8];
+    WriteLE32(buf, flags);
+    WriteLE32(buf + 4, consensusBranchId);
+
+    uint256 entry;
+    CSHA256().Write(nonce.begin(), 32).Write(txid.begin(), 32).Write(buf, sizeof(buf)).Finalize(entry.begin());
+    return entry;
+}
+
+bool CTxValidationCache::Get(const uint256& entry)
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_txvalidationcache);
+    return setValid.count(entry);
+}
+
+void CTxValidationCache::Set(const uint256& entry)
+{
+    size_t nMaxCacheSize = GetArg("-maxtxvalidationcachesize", DEFAULT_MAX_TX_VALIDATION_CACHE_SIZE) * ((size_t) 1 << 20);
+    if (nMaxCacheSize <= 0) return;
+
+    boost::unique_lock<boost::shared_mutex> lock(cs_txvalidationcache);
+    while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
+    {
+        set_type::size_type s = GetRand(setValid.bucket_count());
+        set_type::local_iterator it = setValid.begin(s);
+        if (it != setValid.end(s)) {
+            setValid.erase(*it);
+        }
+    }
+
+    setValid.insert(entry);
+}
+
+void CTxValidationCache::Erase(const uint256& entry)
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_txvalidationcache);
+    setValid.erase(entry);
+}
+
+void CTxValidationCache::Clear()
+{
+    boost::unique_lock<boost::shared_mutex> lock(cs_txvalidationcache);
+    setValid.clear();
+}
+
+size_t CTxValidationCache::Size()
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_txvalidationcache);
+    return setValid.size();
+}
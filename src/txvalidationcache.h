@@ -0,0 +1,59 @@
+// Copyright (c) 2019 The Zel developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or https://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXVALIDATIONCACHE_H
+#define BITCOIN_TXVALIDATIONCACHE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/unordered_set.hpp>
+
+// Limit the validated transaction cache to 8MB (over 100000 entries on
+// 64-bit systems).
+static const unsigned int DEFAULT_MAX_TX_VALIDATION_CACHE_SIZE = 8;
+
+/**
+ * Cache of transactions whose scripts, JoinSplit proofs and Sapling proofs
+ * have already been fully verified (at mempool acceptance), so ConnectBlock
+ * can skip that work when the same transaction shows up in a block.
+ *
+ * Entries are SHA256(nonce || txid || script flags || consensus branch id).
+ * The txid commits to every proof and signature of the transaction, and the
+ * consensus branch id changes at each network upgrade, so entries recorded
+ * under one epoch are never matched in the next one.
+ */
+class CTxValidationCache
+{
+private:
+    class CTxValidationCacheHasher
+    {
+    public:
+        size_t operator()(const uint256& key) const {
+            return key.GetCheapHash();
+        }
+    };
+
+    uint256 nonce;
+    typedef boost::unordered_set<uint256, CTxValidationCacheHasher> set_type;
+    set_type setValid;
+    boost::shared_mutex cs_txvalidationcache;
+
+public:
+    CTxValidationCache();
+
+    uint256 ComputeEntry(const uint256& txid, unsigned int flags, uint32_t consensusBranchId) const;
+
+    bool Get(const uint256& entry);
+    void Set(const uint256& entry);
+    void Erase(const uint256& entry);
+    void Clear();
+    size_t Size();
+};
+
+extern CTxValidationCache txValidationCache;
+
+#endif // BITCOIN_TXVALIDATIONCACHE_H
@@ -184,8 +184,9 @@ public:
 
     /** A more secure, salted hash function.
      * @note This hash is not stable between little and big endian.
+     * @param extra  mixed into the result, e.g. the output index of an outpoint.
      */
-    uint64_t GetHash(const uint256& salt) const;
+    uint64_t GetHash(const uint256& salt, uint32_t extra = 0) const;
 };
 
 /* uint256 from const char *.
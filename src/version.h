@@ -9,7 +9,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 170018;
+static const int PROTOCOL_VERSION = 170020;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -42,4 +42,10 @@ static const int MIN_PEER_PROTO_VERSION_ZELNODE = 170009;
 //! protocol version that means they support deterministic zelnodes, not used as of now, usage of UPGRADE_KAMATA
 static const int DETERMINISTIC_ZELNODES = 170016;
 
+//! "sendcmpct", "cmpctblock", "getblocktxn" and "blocktxn" messages are supported starting with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 170019;
+
+//! "sendheaders" command and announcing blocks with headers starts with this version
+static const int SENDHEADERS_VERSION = 170020;
+
 #endif // BITCOIN_VERSION_H